@@ -0,0 +1,40 @@
+#include "baud.h"
+
+#define _B(n) { n, B ## n }
+const struct brcm_baud_rate brcm_baud_rates[] = {
+	_B(115200),
+	_B(230400),
+	_B(460800),
+	_B(500000),
+	_B(576000),
+	_B(921600),
+	_B(1000000),
+	_B(1152000),
+	_B(1500000),
+	_B(2000000),
+	_B(2500000),
+	_B(3000000),
+#ifndef __CYGWIN__
+	_B(3500000),
+	_B(4000000),
+#endif
+};
+
+const unsigned brcm_baud_rates_count = sizeof (brcm_baud_rates) / sizeof (brcm_baud_rates[0]);
+
+/* Returns the Bxxxx constant for requested_rate, BOTHER for any other
+   rate we can program directly, or -1 if the rate is unusable. */
+int
+validate_baudrate(int requested_rate)
+{
+	for (unsigned i = 0; i < brcm_baud_rates_count; i++)
+		if (brcm_baud_rates[i].rate == requested_rate)
+			return brcm_baud_rates[i].termios_value;
+
+#ifdef BOTHER
+	if (requested_rate >= brcm_baud_rates[0].rate && requested_rate <= BRCM_MAX_BAUDRATE)
+		return BOTHER;
+#endif
+
+	return -1;
+}
@@ -0,0 +1,29 @@
+#ifndef _HAVE_BAUD_H
+#define _HAVE_BAUD_H
+
+#include <termios.h>
+#ifndef ANDROID
+#include <sys/ioctl.h>
+#endif
+
+/* Fastest rate we will ask a controller UART to run at. */
+#define BRCM_MAX_BAUDRATE	6000000
+
+/* Rates without a Bxxxx constant are programmed through termios2 with
+   BOTHER, when the kernel has it. */
+#if defined(TCGETS2) && !defined(BOTHER)
+#define BOTHER	0010000
+#endif
+
+struct brcm_baud_rate {
+	int			rate;
+	speed_t	termios_value;
+};
+
+/* baud.c */
+extern const struct brcm_baud_rate brcm_baud_rates[];
+extern const unsigned brcm_baud_rates_count;
+
+int validate_baudrate(int requested_rate);
+
+#endif
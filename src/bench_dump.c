@@ -0,0 +1,108 @@
+/*
+ *  bench_dump.c
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ *  Name: bench_dump.c
+ *
+ *  Description:
+ *
+ *   Throughput of dump() against the per-byte fprintf() version it
+ *   replaced, on what -d prints for a 60 KB download: one dump per
+ *   Write_RAM command and one per Command Complete.  Output goes to
+ *   /dev/null so only formatting and stdio are measured.
+ *
+ *     make bench && ./bench_dump [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dump.h"
+
+#define DOWNLOAD_BYTES	(60 * 1024)
+#define RECORD_BYTES		255
+
+static void
+legacy_dump(const uint8_t *out, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (i && !(i % 16)) {
+			fprintf(stderr, "\n");
+		}
+
+		fprintf(stderr, "%02x ", out[i]);
+	}
+
+	fprintf(stderr, "\n");
+}
+
+static double
+now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+download(void (*fn)(const uint8_t *, size_t), const uint8_t *record)
+{
+	static const uint8_t event[] = { 0x04, 0x0e, 0x04, 0x01, 0x4c, 0xfc, 0x00 };
+
+	for (int sent = 0; sent < DOWNLOAD_BYTES; sent += RECORD_BYTES) {
+		fn(record, 4 + RECORD_BYTES);
+		fn(event, sizeof(event));
+	}
+}
+
+static void
+legacy(const uint8_t *out, size_t len)
+{
+	legacy_dump(out, len);
+}
+
+int
+main(int argc, char **argv)
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 20;
+	uint8_t record[4 + RECORD_BYTES];
+	double t, legacy_s, table_s;
+
+	for (unsigned i = 0; i < sizeof(record); i++)
+		record[i] = rand();
+
+	if (freopen("/dev/null", "w", stderr) == NULL)
+		return 1;
+
+	t = now_s();
+	for (int i = 0; i < iterations; i++)
+		download(legacy, record);
+	legacy_s = (now_s() - t) / iterations;
+
+	t = now_s();
+	for (int i = 0; i < iterations; i++)
+		download(dump, record);
+	table_s = (now_s() - t) / iterations;
+
+	printf("per 60 KB download: fprintf per byte %.2f ms, table %.2f ms (%.1fx)\n",
+		legacy_s * 1e3, table_s * 1e3, legacy_s / table_s);
+
+	return 0;
+}
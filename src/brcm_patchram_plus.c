@@ -32,6 +32,11 @@
 **						<--enable_lpm>
 **						<--enable_hci>
 **						<--use_baudrate_for_download>
+**						<--autobaud>
+**						<--autobaud_cache=file>
+**						<--detect_baud>
+**						<--low_latency>
+**						<--stats>
 **						<--scopcm=sco_routing,pcm_interface_rate,frame_type,
 **							sync_mode,clock_mode,lsb_first,fill_bits,
 **							fill_method,fill_num,right_justify>
@@ -81,6 +86,23 @@
 **                          do not generate these two bytes.>
 **						<--tosleep=number of microsseconds to sleep before
 **							patchram download begins.>
+**						<--flow_control=on|off|auto>
+**						<--baud_preserved>
+**						<--verify=samples|hash:k>
+**						<--no_quirks>
+**						<--firmware_dir=directory>
+**						<--firmware_index=file>
+**						<--embedded>
+**						<--trace=file>
+**						<--btsnoop=file>
+**						<--flightrec=file>
+**						<--metrics=file>
+**						<--record=file>
+**						<--probe[=msec]>
+**						<--realtime[=priority]>
+**						<--cpu=n>
+**						<--ready_fd=n>
+**						<--background>
 **						uart_device_name
 **
 **                 For example:
@@ -88,6 +110,12 @@
 **                 brcm_patchram_plus -d --patchram  \
 **						BCM2045B2_002.002.011.0348.0349.hcd /dev/ttyHS0
 **
+**                 --probe takes any number of uarts, asks each for its
+**                 chip id, firmware version and bdaddr, all at once,
+**                 and prints a line of JSON per uart:
+**
+**                 brcm_patchram_plus --probe=2000 /dev/ttyS1 /dev/ttyS2
+**
 **                 It will return 0 for success and a number greater than 0
 **                 for any errors.
 **
@@ -126,8 +154,23 @@
 
 #include <string.h>
 #include <signal.h>
+#include <sched.h>
 
 #include "common.h"
+#include "dump.h"
+#include "hcd.h"
+#include "chip_quirks.h"
+#include "fwdir.h"
+#include "embedded_hcd.h"
+#include "trace.h"
+#include "btsnoop.h"
+#include "flightrec.h"
+#include "inventory.h"
+#include "metrics.h"
+#include "notify.h"
+#include "probes.h"
+#include "realtime.h"
+#include "session.h"
 
 #ifdef ANDROID
 #include <cutils/properties.h>
@@ -159,7 +202,6 @@ typedef unsigned char uchar;
 
 int uart_fd = -1;
 int hcdfile_fd = -1;
-int termios_baudrate = 0;
 int bdaddr_flag = 0;
 int enable_lpm = 0;
 int enable_hci = 0;
@@ -170,8 +212,42 @@ int i2s = 0;
 int no2bytes = 0;
 int tosleep = 0;
 int baudrate = 0;
+int flow_control = FLOW_CONTROL_ON;
+int flow_control_given = 0;
+int autobaud = 0;
+int detect_baud = 0;
+int current_baudrate = 115200;
+int low_latency = 0;
+int baud_preserved = 0;
+int controller_fresh = 0;
+int stats = 0;
+unsigned retransmissions = 0;
+unsigned resumes = 0;
+int verify_samples = 0;
+int verify_hash = 0;
+int no_quirks = 0;
+int use_embedded = 0;
+int chip_id = -1;
+int background = 0;
+int realtime = 0;
+int realtime_priority = REALTIME_PRIORITY;
+int realtime_cpu = -1;
+int probe_only = 0;
+int probe_deadline = INVENTORY_DEADLINE;
+int probe_count = 0;
+char **probe_devices = NULL;
+char *autobaud_cache = "/var/cache/brcm_patchram_plus.baud";
+char *uart_path = NULL;
+char *firmware_dir = NULL;
+char *flightrec_path = NULL;
+char *firmware_index = "/var/cache/brcm_patchram_plus.hcd_index";
+const struct embedded_hcd *embedded = NULL;
 
 struct termios termios;
+struct uart_icount icount_start;
+struct uart_latency latency_saved = { .fd = -1 };
+struct rtt_stats rtt;
+uint64_t cmd_sent_us;
 uchar buffer[1024];
 
 uchar hci_reset[] = { 0x01, 0x03, 0x0c, 0x00 };
@@ -200,6 +276,15 @@ uchar hci_write_i2spcm_interface_param[] =
 uchar hci_write_uart_clock_setting_48Mhz[] =
 	{ 0x01, 0x45, 0xfc, 0x01, 0x01 };
 
+uchar hci_read_local_version[] = { 0x01, 0x01, 0x10, 0x00 };
+
+uchar hci_read_local_name[] = { 0x01, 0x14, 0x0c, 0x00 };
+
+uchar hci_read_verbose_config_version_info[] = { 0x01, 0x79, 0xfc, 0x00 };
+
+uchar hci_read_ram[] = { 0x01, 0x4d, 0xfc, 0x05, 0x00, 0x00, 0x00, 0x00,
+	0x00 };
+
 int
 parse_patchram(char *optarg)
 {
@@ -225,56 +310,16 @@ parse_patchram(char *optarg)
 	return(0);
 }
 
-void
-BRCM_encode_baud_rate(uint baud_rate, uchar *encoded_baud)
-{
-	if(baud_rate == 0 || encoded_baud == NULL) {
-		fprintf(stderr, "Baudrate not supported!");
-		return;
-	}
-
-	encoded_baud[3] = (uchar)(baud_rate >> 24);
-	encoded_baud[2] = (uchar)(baud_rate >> 16);
-	encoded_baud[1] = (uchar)(baud_rate >> 8);
-	encoded_baud[0] = (uchar)(baud_rate & 0xFF);
-}
-
-typedef struct {
-	int baud_rate;
-	int termios_value;
-} tBaudRates;
-
-tBaudRates baud_rates[] = {
-	{ 115200, B115200 },
-	{ 230400, B230400 },
-	{ 460800, B460800 },
-	{ 500000, B500000 },
-	{ 576000, B576000 },
-	{ 921600, B921600 },
-	{ 1000000, B1000000 },
-	{ 1152000, B1152000 },
-	{ 1500000, B1500000 },
-	{ 2000000, B2000000 },
-	{ 2500000, B2500000 },
-	{ 3000000, B3000000 },
-#ifndef __CYGWIN__
-	{ 3500000, B3500000 },
-	{ 4000000, B4000000 }
-#endif
-};
-
 int
 parse_baudrate(char *optarg)
 {
-	int baudrate = atoi(optarg);
-
-	termios_baudrate = validate_baudrate(baudrate);
+	baudrate = atoi(optarg);
 
-	if (termios_baudrate == -1)
+	if (validate_baudrate(baudrate) == -1)
 		return -1;
 
 	BRCM_encode_baud_rate(baudrate, &hci_update_baud_rate[6]);
-	return termios_baudrate;
+	return 0;
 }
 
 int
@@ -368,6 +413,156 @@ parse_i2s(char *optarg)
 	return(0);
 }
 
+int
+parse_autobaud(void)
+{
+	autobaud = 1;
+	use_baudrate_for_download = 1;
+	return 0;
+}
+
+int
+parse_autobaud_cache(char *optarg)
+{
+	autobaud_cache = optarg;
+	return 0;
+}
+
+int
+parse_detect_baud(void)
+{
+	detect_baud = 1;
+	return 0;
+}
+
+int
+parse_low_latency(void)
+{
+	low_latency = 1;
+	return 0;
+}
+
+int
+parse_stats(void)
+{
+	stats = 1;
+	return 0;
+}
+
+int
+parse_flow_control(char *optarg)
+{
+	if ((flow_control = parse_flow_control_mode(optarg)) == -1) {
+		return 1;
+	}
+
+	flow_control_given = 1;
+	return 0;
+}
+
+int
+parse_firmware_dir(char *optarg)
+{
+	firmware_dir = optarg;
+	return 0;
+}
+
+int
+parse_firmware_index(char *optarg)
+{
+	firmware_index = optarg;
+	return 0;
+}
+
+int
+parse_embedded(void)
+{
+	if (embedded_hcd_count == 0) {
+		fprintf(stderr, "No firmware was built in, see EMBED_HCD\n");
+		return 1;
+	}
+
+	use_embedded = 1;
+	return 0;
+}
+
+int
+parse_trace(char *optarg)
+{
+	if (trace_open(optarg, "brcm_patchram_plus") == -1) {
+		fprintf(stderr, "trace file %s could not be opened, error %d\n", optarg, errno);
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+parse_btsnoop(char *optarg)
+{
+	if (btsnoop_open(optarg) == -1) {
+		fprintf(stderr, "btsnoop file %s could not be opened, error %d\n", optarg, errno);
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+parse_flightrec(char *optarg)
+{
+	flightrec_path = optarg;
+	return 0;
+}
+
+int
+parse_metrics(char *optarg)
+{
+	if (metrics_open(optarg, "brcm_patchram_plus") == -1) {
+		fprintf(stderr, "metrics file %s could not be created, error %d\n", optarg, errno);
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+parse_record(char *optarg)
+{
+	if (session_open(optarg) == -1) {
+		fprintf(stderr, "session file %s could not be opened, error %d\n", optarg, errno);
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+parse_no_quirks(void)
+{
+	no_quirks = 1;
+	return 0;
+}
+
+int
+parse_baud_preserved(void)
+{
+	baud_preserved = 1;
+	return 0;
+}
+
+int
+parse_verify(char *optarg)
+{
+	if (strncmp(optarg, "hash:", 5) == 0) {
+		verify_hash = atoi(optarg + 5);
+	} else {
+		verify_samples = atoi(optarg);
+	}
+
+	return verify_hash <= 0 && verify_samples <= 0;
+}
+
 int
 parse_no2bytes(void)
 {
@@ -375,6 +570,47 @@ parse_no2bytes(void)
 	return 0;
 }
 
+int
+parse_background(void)
+{
+	background = 1;
+	return 0;
+}
+
+int
+parse_realtime(char *optarg)
+{
+	realtime = 1;
+
+	if (optarg) {
+		realtime_priority = atoi(optarg);
+	}
+
+	return realtime_priority < sched_get_priority_min(SCHED_FIFO) ||
+		realtime_priority > sched_get_priority_max(SCHED_FIFO);
+}
+
+int
+parse_cpu(char *optarg)
+{
+	char *end;
+
+	realtime_cpu = strtol(optarg, &end, 0);
+	return *end != '\0' || realtime_cpu < 0;
+}
+
+int
+parse_probe(char *optarg)
+{
+	probe_only = 1;
+
+	if (optarg) {
+		probe_deadline = atoi(optarg);
+	}
+
+	return probe_deadline <= 0;
+}
+
 int
 parse_tosleep(char *optarg)
 {
@@ -429,7 +665,57 @@ usage(char *argv0)
 	printf("\t\tbefore starting patchram download. Newer chips\n");
 	printf("\t\tdo not generate these two bytes.>\n");
 	printf("\t<--tosleep=microseconds>\n");
-	printf("\tuart_device_name\n");
+	printf("\t<--autobaud> - find the fastest reliable baudrate\n");
+	printf("\t\tand use it for downloading the firmware\n");
+	printf("\t<--autobaud_cache=file> - where --autobaud remembers\n");
+	printf("\t\tthe rate per uart (default %s)\n", autobaud_cache);
+	printf("\t<--detect_baud> - find the rate a previous run left the\n");
+	printf("\t\tcontroller at instead of assuming 115200\n");
+	printf("\t<--low_latency> - tune the uart for command round trips\n");
+	printf("\t<--stats> - report command round trip times\n");
+	printf("\t<--flow_control=on|off|auto> - RTS/CTS, auto probes\n");
+	printf("\t\tfor it and limits the baudrate without it\n");
+	printf("\t<--baud_preserved> - the controller keeps its baudrate\n");
+	printf("\t\tacross Launch_RAM\n");
+	printf("\t<--verify=samples|hash:k> - read back random samples, or\n");
+	printf("\t\tevery range whose address hashes to 0 mod k,\n");
+	printf("\t\tbefore launching the patchram\n");
+	printf("\t<--no_quirks> - do not look the chip up in the quirks table\n");
+	printf("\t<--firmware_dir=directory> - pick the newest .hcd file for\n");
+	printf("\t\tthe controller's chip instead of --patchram\n");
+	printf("\t<--firmware_index=file> - where --firmware_dir keeps its\n");
+	printf("\t\tindex (default %s)\n", firmware_index);
+	printf("\t<--embedded> - use the firmware built in for the chip,\n");
+	printf("\t\tbefore --firmware_dir:");
+
+	for (unsigned i = 0; i < embedded_hcd_count; i++) {
+		printf(" %s (%02x)", embedded_hcds[i].name, embedded_hcds[i].chip_id);
+	}
+
+	printf("%s\n", embedded_hcd_count ? "" : " none");
+	printf("\t<--trace=file> - write a timeline of the session as\n");
+	printf("\t\ttrace-event JSON (Perfetto, chrome://tracing)\n");
+	printf("\t<--btsnoop=file> - capture the HCI traffic in btsnoop format\n");
+	printf("\t\t(not with --probe)\n");
+	printf("\t<--flightrec=file> - where the last packets go on a failure\n");
+	printf("\t\t(default stderr)\n");
+	printf("\t<--metrics=file> - write session metrics for the node_exporter\n");
+	printf("\t\ttextfile collector (a .prom file)\n");
+	printf("\t<--record=file> - record the session with its timing for\n");
+	printf("\t\tbrcm_replay\n");
+	printf("\t<--realtime[=priority]> - download under SCHED_FIFO (default\n");
+	printf("\t\tpriority %d) with memory locked and the image faulted in\n", REALTIME_PRIORITY);
+	printf("\t<--cpu=n> - with --realtime, download from cpu n only\n");
+	printf("\t<--ready_fd=n> - once the controller is patched, and with\n");
+	printf("\t\t--enable_hci once hciN has registered, write its name\n");
+	printf("\t\tto descriptor n, or count 1 if n is an eventfd\n");
+	printf("\t<--background> - patch from a child and return at once,\n");
+	printf("\t\tleaving --ready_fd or systemd to say when it is done\n");
+	printf("\t\t(a Type=notify unit needs NotifyAccess=all)\n");
+	printf("\t<--probe[=msec]> - patch nothing, report the chip, firmware\n");
+	printf("\t\tand bdaddr of every uart given as a line of JSON\n");
+	printf("\t\teach, all within msec (default %d)\n", INVENTORY_DEADLINE);
+	printf("\tuart_device_name...\n");
 }
 
 int
@@ -437,69 +723,142 @@ parse_cmd_line(int argc, char **argv)
 {
 	int ret = 0;
 
-	typedef int (*PFI)();
-
-	PFI parse[] = {
-		parse_patchram,
-		parse_baudrate,
-		parse_bdaddr,
-		parse_enable_lpm,
-		parse_enable_hci,
-		parse_use_baudrate_for_download,
-		parse_scopcm,
-		parse_i2s,
-		parse_no2bytes,
-		parse_tosleep
-	};
-
 	static struct option long_options[] = {
+		{ "autobaud",		0, 0, 'A' },
+		{ "autobaud_cache",	1, 0, 'C' },
 		{ "baud",				1, 0, 'B' },
+		{ "background",	0, 0, 'G' },
+		{ "baud_preserved",	0, 0, 'k' },
 		{ "bdaddr",			1, 0, 'b' },
+		{ "cpu",				1, 0, 'c' },
+		{ "btsnoop",		1, 0, 'N' },
+		{ "detect_baud",	0, 0, 'D' },
+		{ "embedded",		0, 0, 'E' },
 		{ "enable-hci",	0, 0, 'h' },
 		{ "enable-lpm",	0, 0, 'l' },
+		{ "firmware_dir",	1, 0, 'F' },
+		{ "firmware_index",	1, 0, 'I' },
+		{ "flightrec",	1, 0, 'R' },
+		{ "flow_control",	1, 0, 'f' },
 		{ "i2s",				1, 0, 'i' },
+		{ "low_latency",	0, 0, 'L' },
+		{ "metrics",		1, 0, 'M' },
 		{ "no2bytes",		0, 0, 'n' },
+		{ "no_quirks",	0, 0, 'Q' },
 		{ "patchram",		1, 0, 'p' },
+		{ "probe",			2, 0, 'P' },
+		{ "ready_fd",		1, 0, 'Y' },
+		{ "realtime",		2, 0, 'X' },
+		{ "record",			1, 0, 'r' },
 		{ "scopcm",			1, 0, 's' },
+		{ "stats",			0, 0, 'S' },
 		{ "tosleep",		1, 0, 't' },
+		{ "trace",			1, 0, 'T' },
 		{ "use_baudrate_for_download", 0, 0, 'u' },
+		{ "verify",			1, 0, 'V' },
 		{ NULL,					0, 0, 0}
 	};
 
 	int arg, option_index = 0;
-	while ((arg = getopt_long_only(argc, argv, "B:b:hli:np:s:t:u", long_options, &option_index)) != -1) {
+	while ((arg = getopt_long_only(argc, argv, "AB:b:C:c:DdEF:f:GhI:kLlM:i:N:nP::p:QR:r:Ss:T:t:uV:X::Y:", long_options, &option_index)) != -1) {
 		switch (arg) {
+			case 'A':		/* --autobaud */
+				ret = parse_autobaud();
+				break;
+			case 'C':		/* --autobaud_cache */
+				ret = parse_autobaud_cache(optarg);
+				break;
 			case 'B':		/* --baud */
+				ret = parse_baudrate(optarg);
 				break;
 			case 'b':		/* --bdaddr */
+				ret = parse_bdaddr(optarg);
+				break;
+			case 'c':		/* --cpu */
+				ret = parse_cpu(optarg);
+				break;
+			case 'D':		/* --detect_baud */
+				ret = parse_detect_baud();
+				break;
+			case 'E':		/* --embedded */
+				ret = parse_embedded();
+				break;
+			case 'F':		/* --firmware_dir */
+				ret = parse_firmware_dir(optarg);
+				break;
+			case 'I':		/* --firmware_index */
+				ret = parse_firmware_index(optarg);
+				break;
+			case 'f':		/* --flow_control */
+				ret = parse_flow_control(optarg);
+				break;
+			case 'G':		/* --background */
+				ret = parse_background();
 				break;
 			case 'h':		/* --enable-hci */
+				ret = parse_enable_hci();
 				break;
 			case 'i':		/* --i2s */
+				ret = parse_i2s(optarg);
+				break;
+			case 'k':		/* --baud_preserved */
+				ret = parse_baud_preserved();
+				break;
+			case 'L':		/* --low_latency */
+				ret = parse_low_latency();
 				break;
 			case 'l':		/* --enable-lpm */
+				ret = parse_enable_lpm();
+				break;
+			case 'N':		/* --btsnoop */
+				ret = parse_btsnoop(optarg);
 				break;
 			case 'n':		/* --no2bytes */
+				ret = parse_no2bytes();
+				break;
+			case 'P':		/* --probe */
+				ret = parse_probe(optarg);
 				break;
 			case 'p':		/* --patchram */
+				ret = parse_patchram(optarg);
+				break;
+			case 'M':		/* --metrics */
+				ret = parse_metrics(optarg);
+				break;
+			case 'Q':		/* --no_quirks */
+				ret = parse_no_quirks();
+				break;
+			case 'R':		/* --flightrec */
+				ret = parse_flightrec(optarg);
+				break;
+			case 'r':		/* --record */
+				ret = parse_record(optarg);
+				break;
+			case 'S':		/* --stats */
+				ret = parse_stats();
 				break;
 			case 's':		/* --scopcm */
+				ret = parse_scopcm(optarg);
+				break;
+			case 'T':		/* --trace */
+				ret = parse_trace(optarg);
 				break;
 			case 't':		/* --tosleep */
+				ret = parse_tosleep(optarg);
 				break;
-
-			case 0:
-				if (debug) {
-					printf ("option %s",
-						long_options[option_index].name);
-					if (optarg)
-						printf (" with arg %s", optarg);
-					printf ("\n");
-				}
-
-				ret = (*parse[option_index])(optarg);
-
+			case 'u':		/* --use_baudrate_for_download */
+				ret = parse_use_baudrate_for_download();
+				break;
+			case 'V':		/* --verify */
+				ret = parse_verify(optarg);
+				break;
+			case 'X':		/* --realtime */
+				ret = parse_realtime(optarg);
 				break;
+			case 'Y':		/* --ready_fd */
+				ret = parse_ready_fd(optarg);
+				break;
+
 			case 'd':
 				debug = 1;
 				break;
@@ -521,9 +880,17 @@ parse_cmd_line(int argc, char **argv)
 		return(1);
 	}
 
+	/* Every uart is opened by its own probe. */
+	if (probe_only) {
+		probe_devices = &argv[optind];
+		probe_count = argc - optind;
+		return(0);
+	}
+
 	if (optind < argc) {
-		if (debug)
+		if (log_debug())
 			printf ("%s \n", argv[optind]);
+		uart_path = argv[optind];
 		if ((uart_fd = open(argv[optind], O_RDWR | O_NOCTTY)) == -1) {
 			fprintf(stderr, "port %s could not be opened, error %d\n",
 					argv[optind], errno);
@@ -533,10 +900,11 @@ parse_cmd_line(int argc, char **argv)
 	return(0);
 }
 
+/* One tcsetattr() and one flush are enough to get the line raw, at
+   115200 and quiet. */
 void
 init_uart()
 {
-	tcflush(uart_fd, TCIOFLUSH);
 	tcgetattr(uart_fd, &termios);
 
 #ifndef __CYGWIN__
@@ -550,31 +918,34 @@ init_uart()
 	termios.c_cflag |= CS8;
 #endif
 
-	termios.c_cflag |= CRTSCTS;
-	tcsetattr(uart_fd, TCSANOW, &termios);
-	tcflush(uart_fd, TCIOFLUSH);
-	tcsetattr(uart_fd, TCSANOW, &termios);
-	tcflush(uart_fd, TCIOFLUSH);
-	tcflush(uart_fd, TCIOFLUSH);
+	if (flow_control == FLOW_CONTROL_ON)
+		termios.c_cflag |= CRTSCTS;
+	else
+		termios.c_cflag &= ~CRTSCTS;
 	cfsetospeed(&termios, B115200);
 	cfsetispeed(&termios, B115200);
+
+	uint64_t start = monotonic_us();
 	tcsetattr(uart_fd, TCSANOW, &termios);
+	uint64_t set = monotonic_us();
+	tcflush(uart_fd, TCIOFLUSH);
+	uint64_t flush = monotonic_us();
+
+	if (log_debug()) {
+		fprintf(stderr, "init_uart: 1 tcsetattr in %llu us, 1 tcflush in %llu us\n",
+			(unsigned long long)(set - start), (unsigned long long)(flush - set));
+	}
 }
 
-void
-dump(uchar *out, int len)
+/* Move our end of the link to rate, remembering where it is. */
+static int
+set_uart_rate(int rate)
 {
-	int i;
-
-	for (i = 0; i < len; i++) {
-		if (i && !(i % 16)) {
-			fprintf(stderr, "\n");
-		}
-
-		fprintf(stderr, "%02x ", out[i]);
-	}
+	if (uart_set_baudrate(uart_fd, &termios, rate) == -1)
+		return -1;
 
-	fprintf(stderr, "\n");
+	current_baudrate = rate;
+	return 0;
 }
 
 void
@@ -597,7 +968,16 @@ read_event(int fd, uchar *buffer)
 		len -= count;
 	}
 
-	if (debug) {
+	capture_packet(buffer, 3 + buffer[2], 1);
+	probe_event(buffer, 3 + buffer[2]);
+
+	if (cmd_sent_us) {
+		rtt_record(&rtt, monotonic_us() - cmd_sent_us);
+		metrics_command(monotonic_us() - cmd_sent_us);
+		cmd_sent_us = 0;
+	}
+
+	if (log_debug()) {
 		count += i;
 
 		fprintf(stderr, "received %d\n", count);
@@ -605,104 +985,889 @@ read_event(int fd, uchar *buffer)
 	}
 }
 
+/* Like read_event(), but gives up after timeout milliseconds of
+   silence.  Returns the length of the event or 0. */
+int
+read_event_timeout(int fd, uchar *buffer, size_t size, int timeout)
+{
+	int len = uart_read_event(fd, buffer, size, timeout);
+
+	if (len == 0) {
+		flightrec_failed("timeout");
+		metrics.timeouts++;
+	}
+
+	if (len && cmd_sent_us) {
+		rtt_record(&rtt, monotonic_us() - cmd_sent_us);
+		metrics_command(monotonic_us() - cmd_sent_us);
+		cmd_sent_us = 0;
+	}
+
+	if (log_debug()) {
+		fprintf(stderr, "received %d\n", len);
+		dump(buffer, len);
+	}
+
+	return len;
+}
+
 void
 hci_send_cmd(uchar *buf, int len)
 {
-	if (debug) {
+	if (log_debug()) {
 		fprintf(stderr, "writing\n");
 		dump(buf, len);
 	}
 
+	PROBE_CMD(buf);
 	write(uart_fd, buf, len);
-}
+	cmd_sent_us = monotonic_us();
+	capture_packet(buf, len, 0);
 
-void
-expired(int sig __attribute__ ((unused)))
-{
-	hci_send_cmd(hci_reset, sizeof(hci_reset));
-	alarm(4);
+	if (buf != hci_reset) {
+		controller_fresh = 0;
+	}
 }
 
+#define RESET_TIMEOUT	4000	/* milliseconds */
+
+/* Reset until the controller answers.  The resends go out from here
+   rather than from a SIGALRM handler, so they are captured in order
+   like any other command. */
 void
 proc_reset()
 {
-	signal(SIGALRM, expired);
-
-
-	hci_send_cmd(hci_reset, sizeof(hci_reset));
-
-	alarm(4);
-
-	read_event(uart_fd, buffer);
+	do {
+		PROBE0(reset);
+		hci_send_cmd(hci_reset, sizeof(hci_reset));
+	} while (read_event_timeout(uart_fd, buffer, sizeof(buffer), RESET_TIMEOUT) == 0);
 
-	alarm(0);
+	controller_fresh = 1;
 }
 
-void
-proc_patchram()
+/*
+ * Records are sent one at a time and the offset of the last one the
+ * controller acknowledged is kept as a checkpoint.  A record that times
+ * out or fails is sent again -- Write_RAM to the same address is
+ * idempotent.  If that does not help either, we no longer know what
+ * state the controller is in: reset it, re-enter the minidriver and
+ * carry on from the checkpoint instead of the top of the file.
+ */
+#define PATCHRAM_TIMEOUT	1000	/* milliseconds */
+#define PATCHRAM_RETRIES	3
+#define PATCHRAM_RESUMES	3
+
+static int reset_at(int rate);
+int proc_detect_baudrate();
+
+static void
+enter_minidriver()
 {
-	int len;
+	uint64_t start = monotonic_us();
 
 	hci_send_cmd(hci_download_minidriver, sizeof(hci_download_minidriver));
 
-	read_event(uart_fd, buffer);
+	read_event_timeout(uart_fd, buffer, sizeof(buffer), PATCHRAM_TIMEOUT);
+	trace_span("patchram", "download minidriver", start, monotonic_us(), -1);
 
 	if (!no2bytes) {
-		read(uart_fd, &buffer[0], 2);
+		int got;
+
+		start = monotonic_us();
+		got = read(uart_fd, &buffer[0], 2);
+		trace_span("patchram", "two bytes", start, monotonic_us(), -1);
+
+		if (got > 0) {
+			session_io(buffer, got, 1);
+		}
 	}
 
 	if (tosleep) {
+		start = monotonic_us();
 		usleep(tosleep);
+		trace_span("patchram", "tosleep", start, monotonic_us(), -1);
 	}
+}
 
-	while (read(hcdfile_fd, &buffer[1], 3)) {
-		buffer[0] = 0x01;
+static int
+send_record(const struct hcd_record *rec)
+{
+	uchar cmd[4 + 255];
+	int len, status;
 
-		len = buffer[3];
+	cmd[0] = 0x01;
+	cmd[1] = rec->opcode & 0xff;
+	cmd[2] = rec->opcode >> 8;
+	cmd[3] = rec->plen;
+	memcpy(&cmd[4], rec->params, rec->plen);
 
-		read(hcdfile_fd, &buffer[4], len);
+	uint64_t start = trace_enabled ? monotonic_us() : 0;
 
-		hci_send_cmd(buffer, len + 4);
+	PROBE2(record_start, rec->offset, rec->opcode);
+	hci_send_cmd(cmd, rec->plen + 4);
+	metrics.records++;
+	metrics.bytes += 3 + rec->plen;
 
-		read_event(uart_fd, buffer);
-	}
+	len = read_event_timeout(uart_fd, buffer, sizeof(buffer), PATCHRAM_TIMEOUT);
+
+	if (trace_enabled) {
+		uint64_t end = monotonic_us();
 
-	if (use_baudrate_for_download) {
-		cfsetospeed(&termios, B115200);
-		cfsetispeed(&termios, B115200);
-		tcsetattr(uart_fd, TCSANOW, &termios);
+		trace_span("hcd", "record", start, end, rec->offset);
+
+		if (len) {
+			trace_span("hcd", "wait", start, uart_event_us, rec->offset);
+			trace_span("hcd", "event", uart_event_us, end, rec->offset);
+		}
 	}
-	proc_reset();
-}
 
-void
-proc_baudrate()
-{
+	status = hci_cmd_status(buffer, len, rec->opcode);
+	PROBE2(record_end, rec->offset, status);
 
-	if (baudrate > 3000000) {
-		hci_send_cmd(hci_write_uart_clock_setting_48Mhz,
-			sizeof(hci_write_uart_clock_setting_48Mhz));
+	if (status == 0) {
+		return 0;
+	}
 
-		read_event(uart_fd, buffer);
+	if (len == 0) {
+		fprintf(stderr, "record at offset %zu timed out\n", rec->offset);
+	} else if (status > 0) {
+		fprintf(stderr, "record at offset %zu failed, status 0x%02x\n",
+			rec->offset, status);
 	}
 
-	hci_send_cmd(hci_update_baud_rate, sizeof(hci_update_baud_rate));
+	return -1;
+}
 
-	read_event(uart_fd, buffer);
+static int
+resume_minidriver()
+{
+	if (resumes++ == PATCHRAM_RESUMES) {
+		return -1;
+	}
 
-	cfsetospeed(&termios, termios_baudrate);
-	cfsetispeed(&termios, termios_baudrate);
-	tcsetattr(uart_fd, TCSANOW, &termios);
+	tcflush(uart_fd, TCIOFLUSH);
 
-	if (debug) {
-		fprintf(stderr, "Done setting baudrate\n");
+	if (reset_at(current_baudrate) == -1 && !proc_detect_baudrate()) {
+		return -1;
 	}
+
+	enter_minidriver();
+	return 0;
 }
 
-void
-proc_bdaddr()
+/*
+ * --verify: before Launch_RAM, read part of what was written back with
+ * Read_RAM and compare it with the file.  --verify=N checks N random
+ * samples; --verify=hash:K checks, reproducibly, every Write_RAM range
+ * whose address hashes to 0 modulo K.
+ */
+#define VERIFY_SAMPLE_BYTES	32
+
+/* Whether a record after ranges[i] overwrites any of [addr, addr + len). */
+static int
+overwritten_later(const struct hcd_range *ranges, int count, int i, uint32_t addr, uint32_t len)
 {
-	hci_send_cmd(hci_write_bd_addr, sizeof(hci_write_bd_addr));
+	for (int j = i + 1; j < count; j++) {
+		if (ranges[j].addr < addr + len && addr < ranges[j].addr + ranges[j].len) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Read len bytes at addr back.  Returns 0 if they match data, 1 if
+   they do not, or -1 if the controller did not give them back. */
+static int
+verify_bytes(uint32_t addr, const uint8_t *data, uint32_t len)
+{
+	uchar cmd[sizeof(hci_read_ram)];
+	int rlen;
+
+	memcpy(cmd, hci_read_ram, sizeof(cmd));
+	cmd[4] = addr;
+	cmd[5] = addr >> 8;
+	cmd[6] = addr >> 16;
+	cmd[7] = addr >> 24;
+	cmd[8] = len;
+
+	hci_send_cmd(cmd, sizeof(cmd));
+
+	rlen = read_event_timeout(uart_fd, buffer, sizeof(buffer), PATCHRAM_TIMEOUT);
+
+	if (hci_cmd_status(buffer, rlen, HCD_READ_RAM) != 0 || rlen < 7 + (int)len) {
+		return -1;
+	}
+
+	return memcmp(&buffer[7], data, len) ? 1 : 0;
+}
+
+static uint32_t
+hash_addr(uint32_t addr)
+{
+	return (addr * 2654435761u) >> 16;
+}
+
+/* Tally one verify_bytes() result. */
+static void
+verify_count(int ret, unsigned *mismatches, unsigned *unread)
+{
+	if (ret > 0) {
+		(*mismatches)++;
+	} else if (ret < 0) {
+		(*unread)++;
+	}
+}
+
+void
+proc_verify(const struct hcd_image *hcd)
+{
+	struct hcd_range *ranges;
+	unsigned samples = 0, bytes = 0, mismatches = 0, unread = 0;
+	uint64_t start = monotonic_us();
+	int count = hcd_write_ram_ranges(hcd, &ranges);
+
+	if (count == -1) {
+		fprintf(stderr, "Patchram file could not be read for verification, not launching\n");
+		exit(9);
+	}
+
+	if (verify_hash) {
+		for (int i = 0; i < count; i++) {
+			const struct hcd_range *r = &ranges[i];
+
+			if (hash_addr(r->addr) % verify_hash ||
+					overwritten_later(ranges, count, i, r->addr, r->len)) {
+				continue;
+			}
+
+			for (uint32_t off = 0; off < r->len; off += VERIFY_SAMPLE_BYTES) {
+				uint32_t n = r->len - off < VERIFY_SAMPLE_BYTES ? r->len - off : VERIFY_SAMPLE_BYTES;
+
+				verify_count(verify_bytes(r->addr + off, r->data + off, n), &mismatches, &unread);
+				samples++;
+				bytes += n;
+			}
+		}
+	} else if (count > 0) {
+		uint64_t total = 0;
+
+		for (int i = 0; i < count; i++) {
+			total += ranges[i].len;
+		}
+
+		srandom(monotonic_us() ^ getpid());
+
+		/* Pick bytes uniformly over everything written and check the
+			 sample starting there. */
+		for (int tries = 0; samples < (unsigned)verify_samples && tries < verify_samples * 4; tries++) {
+			uint64_t pick = (uint64_t)random() % total;
+			int i = 0;
+
+			while (pick >= ranges[i].len) {
+				pick -= ranges[i++].len;
+			}
+
+			uint32_t n = ranges[i].len - pick < VERIFY_SAMPLE_BYTES ? ranges[i].len - pick : VERIFY_SAMPLE_BYTES;
+
+			if (overwritten_later(ranges, count, i, ranges[i].addr + pick, n)) {
+				continue;
+			}
+
+			verify_count(verify_bytes(ranges[i].addr + pick, ranges[i].data + pick, n),
+				&mismatches, &unread);
+			samples++;
+			bytes += n;
+		}
+	}
+
+	free(ranges);
+
+	trace_span("patchram", "verify", start, monotonic_us(), -1);
+
+	fprintf(stderr, "verify: %u samples, %u bytes, %llu us, %u mismatches, %u not read back\n",
+		samples, bytes, (unsigned long long)(monotonic_us() - start), mismatches, unread);
+
+	if (mismatches) {
+		fprintf(stderr, "Patchram verification failed, not launching\n");
+		exit(9);
+	}
+}
+
+void
+proc_patchram()
+{
+	struct hcd_image hcd;
+	struct hcd_record rec;
+	size_t checkpoint = 0;
+	int verified = !verify_samples && !verify_hash;
+	int ret;
+
+	if (embedded) {
+		hcd.data = embedded->data;
+		hcd.size = embedded->size;
+		hcd.map = NULL;
+	} else if (hcd_map(&hcd, hcdfile_fd) == -1) {
+		fprintf(stderr, "patchram file could not be mapped, error %d\n", errno);
+		exit(5);
+	}
+
+	/* The image is mapped by now, so mlockall() takes it in too. */
+	if (realtime) {
+		realtime_enter(realtime_priority, realtime_cpu);
+		realtime_prefault(hcd.data, hcd.size);
+	}
+
+	metrics.baudrate = current_baudrate;
+	enter_minidriver();
+
+	while ((ret = hcd_record_at(&hcd, checkpoint, &rec)) == 1) {
+		unsigned try;
+
+		if (rec.opcode == HCD_LAUNCH_RAM && !verified) {
+			proc_verify(&hcd);
+			verified = 1;
+		}
+
+		for (try = 0; try <= PATCHRAM_RETRIES; try++) {
+			if (try) {
+				retransmissions++;
+				metrics.retransmissions++;
+				PROBE2(retransmit, rec.offset, try);
+				tcflush(uart_fd, TCIFLUSH);
+			}
+
+			/* A lost Launch_RAM completion is not worth resending:
+				 the controller is already restarting. */
+			if (send_record(&rec) == 0 || rec.opcode == HCD_LAUNCH_RAM) {
+				break;
+			}
+		}
+
+		if (try > PATCHRAM_RETRIES) {
+			if (resume_minidriver() == -1) {
+				fprintf(stderr, "Lost the controller at patchram offset %zu\n", checkpoint);
+				exit(8);
+			}
+
+			if (log_debug()) {
+				fprintf(stderr, "resuming patchram at offset %zu\n", checkpoint);
+			}
+
+			continue;
+		}
+
+		checkpoint = rec.next;
+	}
+
+	if (ret == -1) {
+		fprintf(stderr, "patchram file truncated at offset %zu\n", checkpoint);
+	}
+
+	/* Without a Launch_RAM record the controller is still in the
+		 minidriver, so what was written can be read back here. */
+	if (!verified) {
+		fprintf(stderr, "verify: no Launch_RAM in the patchram file, verifying at the end\n");
+		proc_verify(&hcd);
+	}
+
+	realtime_leave();
+	hcd_unmap(&hcd);
+}
+
+void
+proc_baudrate()
+{
+
+	if (baudrate > 3000000) {
+		hci_send_cmd(hci_write_uart_clock_setting_48Mhz,
+			sizeof(hci_write_uart_clock_setting_48Mhz));
+
+		read_event(uart_fd, buffer);
+	}
+
+	hci_send_cmd(hci_update_baud_rate, sizeof(hci_update_baud_rate));
+
+	read_event(uart_fd, buffer);
+
+	if (set_uart_rate(baudrate) == -1) {
+		fprintf(stderr, "Can't set uart to %d baud\n", baudrate);
+		exit(6);
+	}
+
+	if (log_debug()) {
+		fprintf(stderr, "Done setting baudrate\n");
+	}
+}
+
+/*
+ * --autobaud: step the controller up through brcm_baud_rates[] and keep
+ * the fastest rate at which a burst of commands comes back clean.  The
+ * winner is remembered per uart in autobaud_cache and tried first on
+ * the next run.
+ */
+#define AUTOBAUD_BURST		16
+#define AUTOBAUD_TIMEOUT	100		/* milliseconds */
+#define AUTOBAUD_SETTLE		10000	/* microseconds */
+
+struct link_stats {
+	unsigned sent;
+	unsigned errors;		/* garbled or unexpected events */
+	unsigned retries;		/* commands that got no answer at all */
+};
+
+/* Send a burst of Read_Local_Version_Information commands.  Returns the
+   number of commands that did not come back intact on the first try,
+   or -1 if one of them did not come back at all. */
+static int
+verify_link(struct link_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	for (unsigned i = 0; i < AUTOBAUD_BURST; i++) {
+		unsigned try;
+
+		for (try = 0; try < 2; try++) {
+			hci_send_cmd(hci_read_local_version, sizeof(hci_read_local_version));
+			stats->sent++;
+
+			int len = uart_read_event(uart_fd, buffer, sizeof(buffer), AUTOBAUD_TIMEOUT);
+
+			if (hci_cmd_status(buffer, len, 0x1001) == 0)
+				break;
+
+			if (len)
+				stats->errors++;
+			else
+				stats->retries++;
+
+			tcflush(uart_fd, TCIFLUSH);
+		}
+
+		if (try == 2)
+			return -1;
+	}
+
+	return stats->errors + stats->retries;
+}
+
+/* Ask the controller to move to rate.  Returns 0 once it has
+   acknowledged, at which point it no longer listens at the old rate. */
+static int
+request_baudrate(int rate)
+{
+	uchar cmd[sizeof(hci_update_baud_rate)];
+
+	memcpy(cmd, hci_update_baud_rate, sizeof(cmd));
+	BRCM_encode_baud_rate(rate, &cmd[6]);
+
+	if (rate > 3000000) {
+		hci_send_cmd(hci_write_uart_clock_setting_48Mhz,
+			sizeof(hci_write_uart_clock_setting_48Mhz));
+
+		uart_read_event(uart_fd, buffer, sizeof(buffer), AUTOBAUD_TIMEOUT);
+	}
+
+	hci_send_cmd(cmd, sizeof(cmd));
+
+	int len = uart_read_event(uart_fd, buffer, sizeof(buffer), AUTOBAUD_TIMEOUT);
+
+	return hci_cmd_status(buffer, len, 0xfc18) == 0 ? 0 : -1;
+}
+
+static void
+follow_baudrate(int rate)
+{
+	set_uart_rate(rate);
+	usleep(AUTOBAUD_SETTLE);
+	tcflush(uart_fd, TCIOFLUSH);
+}
+
+/* The controller is at a rate that does not work; talk it back down
+   to rate, which did. */
+static void
+autobaud_fall_back(int rate)
+{
+	struct link_stats stats;
+
+	for (unsigned try = 0; try < 3; try++) {
+		request_baudrate(rate);
+		follow_baudrate(rate);
+
+		if (verify_link(&stats) >= 0)
+			return;
+	}
+
+	fprintf(stderr, "autobaud: lost the controller falling back to %d baud\n", rate);
+	exit(7);
+}
+
+static int
+autobaud_cache_lookup()
+{
+	FILE *f;
+	char path[256];
+	int rate, found = 0;
+
+	if ((f = fopen(autobaud_cache, "r")) == NULL)
+		return 0;
+
+	while (fscanf(f, "%255s %d", path, &rate) == 2)
+		if (strcmp(path, uart_path) == 0)
+			found = rate;
+
+	fclose(f);
+	return found;
+}
+
+static void
+autobaud_cache_store(int rate)
+{
+	FILE *in, *out;
+	char tmp[256], path[256];
+	int other;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", autobaud_cache);
+
+	if ((out = fopen(tmp, "w")) == NULL)
+		return;
+
+	if ((in = fopen(autobaud_cache, "r")) != NULL) {
+		while (fscanf(in, "%255s %d", path, &other) == 2)
+			if (strcmp(path, uart_path) != 0)
+				fprintf(out, "%s %d\n", path, other);
+		fclose(in);
+	}
+
+	fprintf(out, "%s %d\n", uart_path, rate);
+
+	if (fclose(out) == 0)
+		rename(tmp, autobaud_cache);
+}
+
+static int
+autobaud_try(int rate, int best)
+{
+	struct link_stats stats;
+
+	if (request_baudrate(rate) < 0)
+		return -1;
+
+	follow_baudrate(rate);
+
+	int bad = verify_link(&stats);
+
+	if (log_debug()) {
+		fprintf(stderr, "autobaud: %d baud, %u commands, %u errors, %u retries\n",
+			rate, stats.sent, stats.errors, stats.retries);
+	}
+
+	if (bad != 0) {
+		autobaud_fall_back(best);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+proc_autobaud()
+{
+	int best = current_baudrate;
+	int limit = baudrate ? baudrate : BRCM_MAX_BAUDRATE;
+	int cached = autobaud_cache_lookup();
+
+	if (cached > best && cached <= limit && uart_rate_supported(uart_fd, cached) &&
+			autobaud_try(cached, best) == 0) {
+		best = cached;
+	} else {
+		for (unsigned i = 0; i < brcm_baud_rates_count; i++) {
+			int rate = brcm_baud_rates[i].rate;
+
+			if (rate <= best || rate > limit || !uart_rate_supported(uart_fd, rate))
+				continue;
+
+			/* Rates only get harder from here on. */
+			if (autobaud_try(rate, best) < 0)
+				break;
+
+			best = rate;
+		}
+
+		if (best != cached)
+			autobaud_cache_store(best);
+	}
+
+	if (log_debug()) {
+		fprintf(stderr, "autobaud: using %d baud\n", best);
+	}
+
+	baudrate = best;
+	BRCM_encode_baud_rate(baudrate, &hci_update_baud_rate[6]);
+}
+
+/*
+ * --detect_baud: a previous run may have left the controller at a high
+ * rate, where a reset at 115200 would only time out.  Send HCI_Reset at
+ * the rate we last left it at, the requested rate and then every rate
+ * we know, and stay at the first one that answers.
+ */
+#define DETECT_TIMEOUT	50	/* milliseconds */
+
+static int
+reset_at(int rate)
+{
+	if (set_uart_rate(rate) == -1)
+		return -1;
+
+	tcflush(uart_fd, TCIOFLUSH);
+	hci_send_cmd(hci_reset, sizeof(hci_reset));
+
+	int len = uart_read_event(uart_fd, buffer, sizeof(buffer), DETECT_TIMEOUT);
+
+	if (hci_cmd_status(buffer, len, 0x0c03) != 0) {
+		return -1;
+	}
+
+	controller_fresh = 1;
+	return 0;
+}
+
+/* Returns the rate the controller answered at, or 0. */
+int
+proc_detect_baudrate()
+{
+	int likely[] = { autobaud_cache_lookup(), baudrate, 115200 };
+
+	for (unsigned i = 0; i < sizeof(likely) / sizeof(likely[0]); i++)
+		if (likely[i] && reset_at(likely[i]) == 0)
+			goto found;
+
+	/* Faster rates first: that is where an earlier run would leave it. */
+	for (unsigned i = brcm_baud_rates_count; i-- > 0; )
+		if (reset_at(brcm_baud_rates[i].rate) == 0)
+			goto found;
+
+	set_uart_rate(115200);
+	return 0;
+
+found:
+	if (log_debug()) {
+		fprintf(stderr, "controller answered at %d baud\n", current_baudrate);
+	}
+
+	return current_baudrate;
+}
+
+/* The chip id from Read Verbose Config Version Info, asked for once.
+   Returns -1 if the controller does not say. */
+int
+read_chip_id()
+{
+	int len;
+
+	if (chip_id != -1) {
+		return chip_id;
+	}
+
+	hci_send_cmd(hci_read_verbose_config_version_info,
+		sizeof(hci_read_verbose_config_version_info));
+
+	len = read_event_timeout(uart_fd, buffer, sizeof(buffer), PATCHRAM_TIMEOUT);
+
+	if (hci_cmd_status(buffer, len, 0xfc79) != 0 || len < 8) {
+		return -1;
+	}
+
+	if (log_debug()) {
+		fprintf(stderr, "chip_id is %02x\n", buffer[7]);
+	}
+
+	return metrics.chip_id = chip_id = buffer[7];
+}
+
+/* One child per uart for --probe, each with its own copy of the
+   globals the usual steps work on. */
+static int
+probe_uart(char *path, struct brcm_inventory *inv)
+{
+	uart_path = path;
+
+	if ((uart_fd = open(path, O_RDWR | O_NOCTTY)) == -1) {
+		snprintf(inv->error, sizeof(inv->error), "%s", strerror(errno));
+		return -1;
+	}
+
+	init_uart();
+
+	if (detect_baud) {
+		proc_detect_baudrate();
+	}
+
+	return uart_inventory(uart_fd, inv);
+}
+
+int
+proc_probe()
+{
+	if (probe_count == 0) {
+		fprintf(stderr, "--probe needs at least one uart\n");
+		return 2;
+	}
+
+	return inventory_run(probe_devices, probe_count, probe_deadline, probe_uart) ? 1 : 0;
+}
+
+/* Look the chip up in the quirks table and fill in whatever the
+   command line left to us. */
+void
+proc_quirks()
+{
+	const struct chip_quirks *q;
+
+	if (read_chip_id() == -1 || !(q = chip_quirks_lookup(chip_id))) {
+		return;
+	}
+
+	if (log_debug()) {
+		fprintf(stderr, "using quirks for %s\n", q->name);
+	}
+
+	no2bytes |= q->no2bytes;
+	baud_preserved |= q->baud_preserved;
+
+	if (!tosleep) {
+		tosleep = q->tosleep;
+	}
+
+	if (!flow_control_given && q->flow_control != -1) {
+		flow_control = q->flow_control;
+	}
+
+	if (!q->max_baudrate || (baudrate && baudrate <= q->max_baudrate)) {
+		return;
+	}
+
+	/* For --autobaud, baudrate is the ceiling of the search. */
+	if (baudrate) {
+		fprintf(stderr, "%s: limiting to %d baud\n", q->name, q->max_baudrate);
+	}
+
+	baudrate = q->max_baudrate;
+	BRCM_encode_baud_rate(baudrate, &hci_update_baud_rate[6]);
+}
+
+/* --embedded: no file to open, the image for the chip is in the binary. */
+int
+proc_select_embedded()
+{
+	if (read_chip_id() == -1 || !(embedded = embedded_hcd_lookup(chip_id))) {
+		return -1;
+	}
+
+	if (log_debug()) {
+		fprintf(stderr, "using built in %s, %u records\n", embedded->name,
+			embedded->records);
+	}
+
+	return 0;
+}
+
+/* --firmware_dir: ask the controller for its name and open the newest
+   matching .hcd file through the index. */
+void
+proc_select_firmware()
+{
+	struct fw_index idx;
+	const struct fw_entry *e;
+	char chip[32], path[4096];
+	uint64_t start = monotonic_us();
+	int len;
+
+	hci_send_cmd(hci_read_local_name, sizeof(hci_read_local_name));
+
+	len = read_event_timeout(uart_fd, buffer, sizeof(buffer), PATCHRAM_TIMEOUT);
+
+	if (hci_cmd_status(buffer, len, 0x0c14) != 0 || len < 8) {
+		fprintf(stderr, "Can't read the local name\n");
+		exit(10);
+	}
+
+	buffer[len < (int)sizeof(buffer) ? len : (int)sizeof(buffer) - 1] = '\0';
+	snprintf(chip, sizeof(chip), "%.*s", (int)strcspn((char *)&buffer[7], " "),
+		&buffer[7]);
+
+	if (fw_index_load(&idx, firmware_dir, firmware_index) == -1) {
+		fprintf(stderr, "firmware directory %s could not be read, error %d\n",
+			firmware_dir, errno);
+		exit(10);
+	}
+
+	if ((e = fw_index_select(&idx, chip)) == NULL) {
+		fprintf(stderr, "No firmware for %s in %s\n", chip, firmware_dir);
+		exit(10);
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", firmware_dir, e->name);
+
+	if (log_debug()) {
+		fprintf(stderr, "%s: %s (build %s), %u files, listed %u times, %llu us\n",
+			chip, path, e->build, idx.count, idx.rescans,
+			(unsigned long long)(monotonic_us() - start));
+	}
+
+	if (fw_index_save(&idx, firmware_index) == -1 && log_debug()) {
+		fprintf(stderr, "firmware index %s could not be written, error %d\n",
+			firmware_index, errno);
+	}
+
+	fw_index_free(&idx);
+
+	if ((hcdfile_fd = open(path, O_RDONLY)) == -1) {
+		fprintf(stderr, "file %s could not be opened, error %d\n", path, errno);
+		exit(5);
+	}
+}
+
+/* Settle on RTS/CTS, probing for it with --flow_control=auto, and keep
+   the rate to something the controller can take without it. */
+void
+proc_flow_control()
+{
+	int on = flow_control == FLOW_CONTROL_ON;
+
+	if (flow_control == FLOW_CONTROL_AUTO) {
+		on = uart_probe_flow_control(uart_fd, &termios);
+	}
+
+	/* init_uart() picked a default; the line must match what we settled on. */
+	uart_set_flow_control(uart_fd, &termios, on);
+
+	if (log_debug()) {
+		fprintf(stderr, "flow control %s\n", on ? "on" : "off");
+	}
+
+	if (on) {
+		return;
+	}
+
+	if (autobaud && !baudrate) {
+		baudrate = flow_control_cap(BRCM_MAX_BAUDRATE);
+	} else if (baudrate && flow_control_cap(baudrate) != baudrate) {
+		fprintf(stderr, "No flow control, limiting to %d baud\n",
+			flow_control_cap(baudrate));
+		baudrate = flow_control_cap(baudrate);
+	} else {
+		return;
+	}
+
+	BRCM_encode_baud_rate(baudrate, &hci_update_baud_rate[6]);
+}
+
+void
+proc_bdaddr()
+{
+	hci_send_cmd(hci_write_bd_addr, sizeof(hci_write_bd_addr));
 
 	read_event(uart_fd, buffer);
 }
@@ -738,24 +1903,199 @@ proc_i2s()
 	read_event(uart_fd, buffer);
 }
 
+static void
+restore_latency(void)
+{
+	uart_restore_latency(&latency_saved, &termios);
+}
+
 void
 proc_enable_hci()
 {
 	int i = N_HCI;
 	int proto = HCI_UART_H4;
+	int mon = notify_monitor_open();
+	char name[16];
+
 	if (ioctl(uart_fd, TIOCSETD, &i) < 0) {
 		fprintf(stderr, "Can't set line discipline\n");
+		notify_failed("Can't set line discipline");
 		return;
 	}
 
 	if (ioctl(uart_fd, HCIUARTSETPROTO, proto) < 0) {
 		fprintf(stderr, "Can't set hci protocol\n");
+		notify_failed("Can't set hci protocol");
 		return;
 	}
 	fprintf(stderr, "Done setting line discpline\n");
+
+	/* Ready means the kernel has the device, not merely the ioctls. */
+	int dev_id = notify_hci_registered(uart_fd, mon, NOTIFY_TIMEOUT);
+
+	if (mon != -1) {
+		close(mon);
+	}
+
+	if (dev_id < 0) {
+		fprintf(stderr, "No hci device registered for %s\n", uart_path);
+		notify_failed("No hci device registered");
+		return;
+	}
+
+	snprintf(name, sizeof(name), "hci%d", dev_id);
+	notify_ready(name);
 	return;
 }
 
+/*
+ * The session is planned as a list of steps, each of which moves the
+ * controller to some state.  run_plan() skips any step whose state we
+ * are already in -- a reset right after the one --detect_baud answered,
+ * a baudrate switch to the rate we are already at, the drop to 115200
+ * after Launch_RAM on chips that keep their rate -- and logs what the
+ * step cost the last time it did run.
+ */
+enum plan_step {
+	STEP_RESET,
+	STEP_QUIRKS,
+	STEP_FIRMWARE,
+	STEP_FLOW_CONTROL,
+	STEP_AUTOBAUD,
+	STEP_BAUDRATE,
+	STEP_PATCHRAM,
+	STEP_DEFAULT_BAUDRATE,
+	STEP_BDADDR,
+	STEP_LPM,
+	STEP_SCOPCM,
+	STEP_I2S,
+	STEP_MAX
+};
+
+static const char *step_names[STEP_MAX] = {
+	"reset",
+	"quirks",
+	"firmware",
+	"flow control",
+	"autobaud",
+	"baudrate",
+	"patchram",
+	"default baudrate",
+	"bdaddr",
+	"lpm",
+	"scopcm",
+	"i2s",
+};
+
+struct plan {
+	enum plan_step	steps[16];
+	unsigned				count;
+	uint64_t				cost_us[STEP_MAX];	/* last measured run of each step. */
+};
+
+static void
+plan_add(struct plan *plan, enum plan_step step)
+{
+	plan->steps[plan->count++] = step;
+}
+
+static int
+step_needed(enum plan_step step)
+{
+	switch (step) {
+		case STEP_RESET:
+			return !controller_fresh;
+		case STEP_BAUDRATE:
+			return baudrate && baudrate != current_baudrate;
+		case STEP_DEFAULT_BAUDRATE:
+			return current_baudrate != 115200 && !baud_preserved;
+		default:
+			return 1;
+	}
+}
+
+static void
+run_step(enum plan_step step)
+{
+	switch (step) {
+		case STEP_RESET:
+			proc_reset();
+			break;
+		case STEP_QUIRKS:
+			proc_quirks();
+			break;
+		case STEP_FIRMWARE:
+			if (use_embedded && proc_select_embedded() == 0) {
+				break;
+			}
+
+			if (!firmware_dir) {
+				fprintf(stderr, "No firmware built in for chip %02x\n", chip_id);
+				exit(10);
+			}
+
+			proc_select_firmware();
+			break;
+		case STEP_FLOW_CONTROL:
+			proc_flow_control();
+			break;
+		case STEP_AUTOBAUD:
+			proc_autobaud();
+			break;
+		case STEP_BAUDRATE:
+			proc_baudrate();
+			break;
+		case STEP_PATCHRAM:
+			proc_patchram();
+			break;
+		case STEP_DEFAULT_BAUDRATE:
+			/* Launch_RAM restarts the controller at its default rate. */
+			set_uart_rate(115200);
+			break;
+		case STEP_BDADDR:
+			proc_bdaddr();
+			break;
+		case STEP_LPM:
+			proc_enable_lpm();
+			break;
+		case STEP_SCOPCM:
+			proc_scopcm();
+			break;
+		case STEP_I2S:
+			proc_i2s();
+			break;
+		default:
+			break;
+	}
+}
+
+static void
+run_plan(struct plan *plan)
+{
+	for (unsigned i = 0; i < plan->count; i++) {
+		enum plan_step step = plan->steps[i];
+
+		if (!step_needed(step)) {
+			if (log_debug() && plan->cost_us[step]) {
+				fprintf(stderr, "plan: skipped %s, which took %llu us when it last ran\n",
+					step_names[step], (unsigned long long)plan->cost_us[step]);
+			} else if (log_debug()) {
+				fprintf(stderr, "plan: skipped %s\n", step_names[step]);
+			}
+
+			continue;
+		}
+
+		uint64_t start = monotonic_us();
+
+		flightrec_state(step_names[step]);
+		run_step(step);
+		plan->cost_us[step] = monotonic_us() - start;
+		metrics_phase(step_names[step], plan->cost_us[step]);
+		trace_span("phase", step_names[step], start, start + plan->cost_us[step], -1);
+	}
+}
+
 #ifdef ANDROID
 void
 read_default_bdaddr()
@@ -792,7 +2132,7 @@ read_default_bdaddr()
 		return;
 	}
 
-	if (debug) {
+	if (log_debug()) {
 		printf("Read default bdaddr of %s\n", bdaddr);
 	}
 
@@ -804,6 +2144,8 @@ read_default_bdaddr()
 int
 main (int argc, char **argv)
 {
+	struct plan plan = { .count = 0 };
+
 #ifdef ANDROID
 	read_default_bdaddr();
 #endif
@@ -812,44 +2154,100 @@ main (int argc, char **argv)
 		exit(1);
 	}
 
+	flightrec_init("brcm_patchram_plus", flightrec_path);
+
+	if (probe_only) {
+		exit(proc_probe());
+	}
+
 	if (uart_fd < 0) {
 		exit(2);
 	}
 
+	if (background) {
+		notify_background();
+	}
+
+	/* Only now, so that neither --background nor --probe forks with
+	   the writer running. */
+	if (btsnoop_start() == -1) {
+		fprintf(stderr, "btsnoop capture could not be started\n");
+		exit(1);
+	}
+
 	init_uart();
+	uart_get_icount(uart_fd, &icount_start);
 
-	proc_reset();
+	if (low_latency) {
+		uart_low_latency(uart_fd, &termios, &latency_saved);
+		atexit(restore_latency);
+	}
 
-	if (use_baudrate_for_download) {
-		if (termios_baudrate) {
-			proc_baudrate();
-		}
+	if (detect_baud) {
+		proc_detect_baudrate();
 	}
 
-	if (hcdfile_fd > 0) {
-		proc_patchram();
+	plan_add(&plan, STEP_RESET);
+
+	if ((firmware_dir || use_embedded) && hcdfile_fd <= 0) {
+		plan_add(&plan, STEP_FIRMWARE);
+	}
+
+	if (!no_quirks && (hcdfile_fd > 0 || firmware_dir || use_embedded || baudrate || autobaud)) {
+		plan_add(&plan, STEP_QUIRKS);
+	}
+
+	plan_add(&plan, STEP_FLOW_CONTROL);
+
+	if (autobaud) {
+		plan_add(&plan, STEP_AUTOBAUD);
+	} else if (use_baudrate_for_download) {
+		plan_add(&plan, STEP_BAUDRATE);
 	}
 
-	if (termios_baudrate) {
-		proc_baudrate();
+	if (hcdfile_fd > 0 || firmware_dir || use_embedded) {
+		plan_add(&plan, STEP_PATCHRAM);
+		plan_add(&plan, STEP_DEFAULT_BAUDRATE);
+		plan_add(&plan, STEP_RESET);
 	}
 
+	plan_add(&plan, STEP_BAUDRATE);
+
 	if (bdaddr_flag) {
-		proc_bdaddr();
+		plan_add(&plan, STEP_BDADDR);
 	}
 
 	if (enable_lpm) {
-		proc_enable_lpm();
+		plan_add(&plan, STEP_LPM);
 	}
 
 	if (scopcm) {
-		proc_scopcm();
+		plan_add(&plan, STEP_SCOPCM);
 	}
 
 	if (i2s) {
-		proc_i2s();
+		plan_add(&plan, STEP_I2S);
+	}
+
+	run_plan(&plan);
+
+	if (stats) {
+		char label[64];
+
+		snprintf(label, sizeof(label), "%s latency, %s scheduling",
+			low_latency ? "low" : "default", realtime ? "realtime" : "normal");
+		rtt_report(&rtt, label);
+		uart_report_icount(uart_fd, &icount_start);
+		fprintf(stderr, "patchram: %u retransmissions, %u resumes\n",
+			retransmissions, resumes);
 	}
 
+	restore_latency();
+	metrics_close(1);
+	trace_close();
+	btsnoop_close();
+	flightrec_done();
+
 	if (enable_hci) {
 		proc_enable_hci();
 
@@ -858,5 +2256,6 @@ main (int argc, char **argv)
 		}
 	}
 
+	notify_ready(uart_path);
 	exit(0);
 }
@@ -81,6 +81,15 @@
 **                          do not generate these two bytes.>
 **						<--tosleep=number of microsseconds to sleep before
 **							patchram download begins.>
+**						<--flow_control=on|off|auto>
+**						<--no_quirks>
+**						<--trace=file>
+**						<--btsnoop=file>
+**						<--flightrec=file>
+**						<--metrics=file>
+**						<--probe[=msec]>
+**						<--ready_fd=n>
+**						<--background>
 **						uart_device_name
 **
 **                 For example:
@@ -126,6 +135,15 @@
 #include <time.h>
 
 #include "common.h"
+#include "dump.h"
+#include "chip_quirks.h"
+#include "trace.h"
+#include "btsnoop.h"
+#include "flightrec.h"
+#include "inventory.h"
+#include "metrics.h"
+#include "notify.h"
+#include "probes.h"
 
 #ifdef ANDROID
 #include <cutils/properties.h>
@@ -154,14 +172,10 @@
 #define HCI_UART_LL		4
 #define HCI_UART_H5		5
 
-#define CHIP_ID_4330B2 0x43
-#define CHIP_ID_4329B1 0x29
-
 typedef unsigned char uchar;
 
 int uart_fd = -1;
 int hcdfile_fd = -1;
-int termios_baudrate = 0;
 int bdaddr_flag = 0;
 int enable_lpm = 0;
 int enable_h4 = 0;
@@ -172,8 +186,18 @@ int scopcm = 0;
 int i2s = 0;
 int no2bytes = 0;
 int tosleep = 0;
+int baudrate = 0;
+int flow_control = FLOW_CONTROL_OFF;
+int flow_control_given = 0;
+int no_quirks = 0;
+int probe_only = 0;
+int background = 0;
+int probe_deadline = INVENTORY_DEADLINE;
+char *flightrec_path = NULL;
+uint64_t cmd_sent_us;
 
 struct termios termios;
+struct uart_icount icount_start;
 uchar buffer[1024];
 
 uchar hci_reset[] = { 0x01, 0x03, 0x0c, 0x00 };
@@ -248,33 +272,16 @@ parse_patchram(char *optarg)
 	return 0;
 }
 
-void
-BRCM_encode_baud_rate(uint baud_rate, uchar *encoded_baud)
-{
-	if(baud_rate == 0 || encoded_baud == NULL) {
-		fprintf(stderr, "Baudrate not supported!");
-		return;
-	}
-
-	encoded_baud[3] = (uchar)(baud_rate >> 24);
-	encoded_baud[2] = (uchar)(baud_rate >> 16);
-	encoded_baud[1] = (uchar)(baud_rate >> 8);
-	encoded_baud[0] = (uchar)(baud_rate & 0xFF);
-}
-
-
 int
 parse_baudrate(char *optarg)
 {
-	int baudrate = atoi(optarg);
+	baudrate = atoi(optarg);
 
-	termios_baudrate = validate_baudrate(baudrate);
-
-	if (termios_baudrate == -1)
+	if (validate_baudrate(baudrate) == -1)
 		return -1;
 
 	BRCM_encode_baud_rate(baudrate, &hci_update_baud_rate[6]);
-	return termios_baudrate;
+	return 0;
 }
 
 int
@@ -375,6 +382,64 @@ parse_i2s(char *optarg)
 	return 0;
 }
 
+int
+parse_flow_control(char *optarg)
+{
+	if ((flow_control = parse_flow_control_mode(optarg)) == -1) {
+		return 1;
+	}
+
+	flow_control_given = 1;
+	return 0;
+}
+
+int
+parse_no_quirks(void)
+{
+	no_quirks = 1;
+	return 0;
+}
+
+int
+parse_btsnoop(char *optarg)
+{
+	if (btsnoop_open(optarg) == -1) {
+		fprintf(stderr, "btsnoop file %s could not be opened, error %d\n", optarg, errno);
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+parse_flightrec(char *optarg)
+{
+	flightrec_path = optarg;
+	return 0;
+}
+
+int
+parse_trace(char *optarg)
+{
+	if (trace_open(optarg, "brcm_patchram_plus_h5") == -1) {
+		fprintf(stderr, "trace file %s could not be opened, error %d\n", optarg, errno);
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+parse_metrics(char *optarg)
+{
+	if (metrics_open(optarg, "brcm_patchram_plus_h5") == -1) {
+		fprintf(stderr, "metrics file %s could not be created, error %d\n", optarg, errno);
+		return 1;
+	}
+
+	return 0;
+}
+
 int
 parse_no2bytes(void)
 {
@@ -382,6 +447,25 @@ parse_no2bytes(void)
 	return 0;
 }
 
+int
+parse_probe(char *optarg)
+{
+	probe_only = 1;
+
+	if (optarg) {
+		probe_deadline = atoi(optarg);
+	}
+
+	return probe_deadline <= 0;
+}
+
+int
+parse_background(void)
+{
+	background = 1;
+	return 0;
+}
+
 int
 parse_tosleep(char *optarg)
 {
@@ -436,7 +520,27 @@ usage(char *argv0)
 	printf("\t\tbefore starting patchram download. Newer chips\n");
 	printf("\t\tdo not generate these two bytes.>\n");
 	printf("\t<--tosleep=microseconds>\n");
-	printf("\tuart_device_name\n");
+	printf("\t<--flow_control=on|off|auto> - RTS/CTS, auto probes\n");
+	printf("\t\tfor it and limits the baudrate without it\n");
+	printf("\t<--no_quirks> - do not look the chip up in the quirks table\n");
+	printf("\t<--trace=file> - write a timeline of the session as\n");
+	printf("\t\ttrace-event JSON (Perfetto, chrome://tracing)\n");
+	printf("\t<--btsnoop=file> - capture the HCI traffic in btsnoop format\n");
+	printf("\t\t(not with --probe)\n");
+	printf("\t<--flightrec=file> - where the last packets go on a failure\n");
+	printf("\t\t(default stderr)\n");
+	printf("\t<--metrics=file> - write session metrics for the node_exporter\n");
+	printf("\t\ttextfile collector (a .prom file)\n");
+	printf("\t<--ready_fd=n> - once the controller is patched, and with\n");
+	printf("\t\t--enable_h4/h5 once hciN has registered, write its name\n");
+	printf("\t\tto descriptor n, or count 1 if n is an eventfd\n");
+	printf("\t<--background> - patch from a child and return at once,\n");
+	printf("\t\tleaving --ready_fd or systemd to say when it is done\n");
+	printf("\t\t(a Type=notify unit needs NotifyAccess=all)\n");
+	printf("\t<--probe[=msec]> - patch nothing, report the chip, firmware\n");
+	printf("\t\tand bdaddr of every uart given as a line of JSON\n");
+	printf("\t\teach, all within msec (default %d)\n", INVENTORY_DEADLINE);
+	printf("\tuart_device_name...\n");
 }
 
 int
@@ -450,7 +554,10 @@ parse_cmd_line(int argc, char **argv)
 	PFI parse[] = { parse_patchram, parse_baudrate,
 		parse_bdaddr, parse_enable_lpm, parse_enable_h4,
 		parse_enable_h5, parse_use_baudrate_for_download,
-		parse_scopcm, parse_i2s, parse_no2bytes, parse_tosleep};
+		parse_scopcm, parse_i2s, parse_no2bytes, parse_tosleep,
+		parse_flow_control, parse_no_quirks, parse_trace, parse_btsnoop,
+		parse_flightrec, parse_metrics, parse_probe, parse_ready_fd,
+		parse_background};
 
 
 	while (1) {
@@ -468,6 +575,15 @@ parse_cmd_line(int argc, char **argv)
 			{"i2s", 1, 0, 0},
 			{"no2bytes", 0, 0, 0},
 			{"tosleep", 1, 0, 0},
+			{"flow_control", 1, 0, 0},
+			{"no_quirks", 0, 0, 0},
+			{"trace", 1, 0, 0},
+			{"btsnoop", 1, 0, 0},
+			{"flightrec", 1, 0, 0},
+			{"metrics", 1, 0, 0},
+			{"probe", 2, 0, 0},
+			{"ready_fd", 1, 0, 0},
+			{"background", 0, 0, 0},
 			{0, 0, 0, 0}
 		};
 
@@ -480,7 +596,7 @@ parse_cmd_line(int argc, char **argv)
 
 		switch (c) {
 			case 0:
-				if (debug) {
+				if (log_debug()) {
 					printf ("option %s",
 						long_options[option_index].name);
 					if (optarg)
@@ -512,8 +628,13 @@ parse_cmd_line(int argc, char **argv)
 		return 1;
 	}
 
+	/* Every uart is opened by its own probe. */
+	if (probe_only) {
+		return 0;
+	}
+
 	if (optind < argc) {
-		if (debug)
+		if (log_debug())
 			printf ("%s \n", argv[optind]);
 		if ((uart_fd = open(argv[optind], O_RDWR | O_NOCTTY)) == -1) {
 			fprintf(stderr, "port %s could not be opened, error %d\n",
@@ -524,10 +645,11 @@ parse_cmd_line(int argc, char **argv)
 	return 0;
 }
 
+/* One tcsetattr() and one flush are enough to get the line raw, at
+   115200 and quiet. */
 void
 init_uart()
 {
-	tcflush(uart_fd, TCIOFLUSH);
 	tcgetattr(uart_fd, &termios);
 
 #ifndef __CYGWIN__
@@ -541,31 +663,23 @@ init_uart()
 	termios.c_cflag |= CS8;
 #endif
 
-	termios.c_cflag &= ~CRTSCTS;
-	tcsetattr(uart_fd, TCSANOW, &termios);
-	tcflush(uart_fd, TCIOFLUSH);
-	tcsetattr(uart_fd, TCSANOW, &termios);
-	tcflush(uart_fd, TCIOFLUSH);
-	tcflush(uart_fd, TCIOFLUSH);
+	if (flow_control == FLOW_CONTROL_ON)
+		termios.c_cflag |= CRTSCTS;
+	else
+		termios.c_cflag &= ~CRTSCTS;
 	cfsetospeed(&termios, B115200);
 	cfsetispeed(&termios, B115200);
-	tcsetattr(uart_fd, TCSANOW, &termios);
-}
-
-void
-dump(uchar *out, int len)
-{
-	int i;
 
-	for (i = 0; i < len; i++) {
-		if (i && !(i % 16)) {
-			fprintf(stderr, "\n");
-		}
+	uint64_t start = monotonic_us();
+	tcsetattr(uart_fd, TCSANOW, &termios);
+	uint64_t set = monotonic_us();
+	tcflush(uart_fd, TCIOFLUSH);
+	uint64_t flush = monotonic_us();
 
-		fprintf(stderr, "%02x ", out[i]);
+	if (log_debug()) {
+		fprintf(stderr, "init_uart: 1 tcsetattr in %llu us, 1 tcflush in %llu us\n",
+			(unsigned long long)(set - start), (unsigned long long)(flush - set));
 	}
-
-	fprintf(stderr, "\n");
 }
 
 void
@@ -579,7 +693,7 @@ read_event(int fd, uchar *buffer)
 	len = 3;
 
 	while ((count = read(fd, &buffer[i], len)) < len) {
-		if (debug) {
+		if (log_debug()) {
 			count += i;
 
 			fprintf(stderr, "received %d len %d\n", count, len);
@@ -598,7 +712,15 @@ read_event(int fd, uchar *buffer)
 		len -= count;
 	}
 
-	if (debug) {
+	capture_packet(buffer, 3 + buffer[2], 1);
+	probe_event(buffer, 3 + buffer[2]);
+
+	if (cmd_sent_us) {
+		metrics_command(monotonic_us() - cmd_sent_us);
+		cmd_sent_us = 0;
+	}
+
+	if (log_debug()) {
 		count += i;
 
 		fprintf(stderr, "received %d\n", count);
@@ -609,32 +731,57 @@ read_event(int fd, uchar *buffer)
 void
 hci_send_cmd(uchar *buf, int len)
 {
-	if (debug) {
+	if (log_debug()) {
 		fprintf(stderr, "writing\n");
 		dump(buf, len);
 	}
 
+	/* SLIP frames for the link setup are not H4 commands. */
+	if (buf[0] == 0x01) {
+		PROBE_CMD(buf);
+	}
+
 	write(uart_fd, buf, len);
+	cmd_sent_us = metrics_enabled ? monotonic_us() : 0;
+	capture_packet(buf, len, 0);
+}
+
+/* Resends from the SIGALRM handlers below.  hci_send_cmd() is not
+   async-signal-safe -- it logs through stdio and feeds the btsnoop
+   ring -- so only the write() and the flight recorder happen here, and
+   btsnoop does not see the resend. */
+static volatile sig_atomic_t resets_resent;
+
+static void
+resend(uchar *buf, int len)
+{
+	write(uart_fd, buf, len);
+	flightrec_packet(buf, len, 0);
 }
 
 void
 expired(int sig __attribute__ ((unused)))
 {
-	hci_send_cmd(hci_reset, sizeof(hci_reset));
+	flightrec_failed("timeout");
+	resets_resent++;
+	PROBE0(reset);
+	resend(hci_reset, sizeof(hci_reset));
 	alarm(4);
 }
 
 static void
 slip_expired(int sig __attribute__ ((unused)))
 {
-	hci_send_cmd(slip_sync, sizeof(slip_sync));
+	PROBE1(h5_retransmit, "sync");
+	resend(slip_sync, sizeof(slip_sync));
 	alarm(4);
 }
 
 static void
 slip_config_expired(int sig __attribute ((unused)))
 {
-	hci_send_cmd(slip_config, sizeof(slip_config));
+	PROBE1(h5_retransmit, "config");
+	resend(slip_config, sizeof(slip_config));
 	alarm(4);
 }
 
@@ -643,6 +790,7 @@ proc_reset()
 {
 	signal(SIGALRM, expired);
 
+	PROBE0(reset);
 	hci_send_cmd(hci_reset, sizeof(hci_reset));
 
 	alarm(4);
@@ -650,28 +798,20 @@ proc_reset()
 	read_event(uart_fd, buffer);
 
 	alarm(0);
+
+	metrics.timeouts += resets_resent;
+	resets_resent = 0;
 }
 
 static void
 proc_patchram()
 {
 	int len;
-	uchar chip_id;
-
-	hci_send_cmd(hci_read_verbose_config_version_info, 
-		sizeof(hci_read_verbose_config_version_info));
-
-	read_event(uart_fd, buffer);
-
-	chip_id = buffer[7];
 
-	if (debug) {
-		fprintf(stderr, "chip_id is %02x\n", chip_id);
-	}
+	uint64_t start = monotonic_us();
+	int32_t offset = 0;
 
-	if (chip_id == CHIP_ID_4330B2) {
-		no2bytes = 1;
-	}
+	metrics.baudrate = use_baudrate_for_download && baudrate ? baudrate : 115200;
 
 	hci_send_cmd(hci_download_minidriver, sizeof(hci_download_minidriver));
 
@@ -685,6 +825,8 @@ proc_patchram()
 		usleep(tosleep);
 	}
 
+	trace_span("patchram", "minidriver", start, monotonic_us(), -1);
+
 	while (read(hcdfile_fd, &buffer[1], 3)) {
 		buffer[0] = 0x01;
 
@@ -692,20 +834,75 @@ proc_patchram()
 
 		read(hcdfile_fd, &buffer[4], len);
 
+		start = trace_enabled ? monotonic_us() : 0;
+
+		PROBE2(record_start, offset, buffer[1] | (buffer[2] << 8));
 		hci_send_cmd(buffer, len + 4);
+		metrics.records++;
+		metrics.bytes += 3 + len;
 
 		read_event(uart_fd, buffer);
+		PROBE2(record_end, offset, buffer[1] == 0x0e ? buffer[6] : -1);
+
+		trace_span("hcd", "record", start, trace_enabled ? monotonic_us() : 0, offset);
+		offset += 3 + len;
 	}
 
 	if (use_baudrate_for_download) {
-		cfsetospeed(&termios, B115200);
-		cfsetispeed(&termios, B115200);
-		tcsetattr(uart_fd, TCSANOW, &termios);
+		uart_set_baudrate(uart_fd, &termios, 115200);
 	}
 
 	proc_reset();
 }
 
+/* Look the chip up in the quirks table and fill in whatever the
+   command line left to us. */
+static void
+proc_quirks()
+{
+	const struct chip_quirks *q;
+	int len;
+
+	hci_send_cmd(hci_read_verbose_config_version_info,
+		sizeof(hci_read_verbose_config_version_info));
+
+	len = uart_read_event(uart_fd, buffer, sizeof(buffer), 1000);
+
+	if (hci_cmd_status(buffer, len, 0xfc79) != 0 || len < 8) {
+		return;
+	}
+
+	if (log_debug()) {
+		fprintf(stderr, "chip_id is %02x\n", buffer[7]);
+	}
+
+	metrics.chip_id = buffer[7];
+
+	if (!(q = chip_quirks_lookup(buffer[7]))) {
+		return;
+	}
+
+	if (log_debug()) {
+		fprintf(stderr, "using quirks for %s\n", q->name);
+	}
+
+	no2bytes |= q->no2bytes;
+
+	if (!tosleep) {
+		tosleep = q->tosleep;
+	}
+
+	if (!flow_control_given && q->flow_control != -1) {
+		flow_control = q->flow_control;
+	}
+
+	if (q->max_baudrate && baudrate > q->max_baudrate) {
+		fprintf(stderr, "%s: limiting to %d baud\n", q->name, q->max_baudrate);
+		baudrate = q->max_baudrate;
+		BRCM_encode_baud_rate(baudrate, &hci_update_baud_rate[6]);
+	}
+}
+
 static void
 proc_baudrate()
 {
@@ -713,17 +910,51 @@ proc_baudrate()
 
 	read_event(uart_fd, buffer);
 
-	cfsetospeed(&termios, termios_baudrate);
-	cfsetispeed(&termios, termios_baudrate);
-	tcsetattr(uart_fd, TCSANOW, &termios);
+	if (uart_set_baudrate(uart_fd, &termios, baudrate) == -1) {
+		fprintf(stderr, "Can't set uart to %d baud\n", baudrate);
+		exit(6);
+	}
 
-	if (debug) {
+	if (log_debug()) {
 		fprintf(stderr, "Done setting baudrate\n");
 	}
 
 	sleep(1);
 }
 
+/* Settle on RTS/CTS, probing for it with --flow_control=auto, and keep
+   the rate to something the controller can take without it. */
+static void
+proc_flow_control()
+{
+	int on = flow_control == FLOW_CONTROL_ON;
+
+	if (flow_control == FLOW_CONTROL_AUTO) {
+		on = uart_probe_flow_control(uart_fd, &termios);
+	}
+
+	/* init_uart() picked a default; the line must match what we settled on. */
+	uart_set_flow_control(uart_fd, &termios, on);
+
+	if (log_debug()) {
+		fprintf(stderr, "flow control %s\n", on ? "on" : "off");
+	}
+
+	if (on) {
+		return;
+	}
+
+	if (baudrate && flow_control_cap(baudrate) != baudrate) {
+		fprintf(stderr, "No flow control, limiting to %d baud\n",
+			flow_control_cap(baudrate));
+		baudrate = flow_control_cap(baudrate);
+	} else {
+		return;
+	}
+
+	BRCM_encode_baud_rate(baudrate, &hci_update_baud_rate[6]);
+}
+
 static void
 proc_bdaddr()
 {
@@ -768,21 +999,40 @@ proc_enable_hci()
 {
 	int i = N_HCI;
 	int proto = (enable_h4 ? HCI_UART_H4 : HCI_UART_H5);
+	int mon = notify_monitor_open();
+	char name[16];
 
 	if (ioctl(uart_fd, TIOCSETD, &i) < 0) {
 		fprintf(stderr, "Can't set line discipline\n");
+		notify_failed("Can't set line discipline");
 		return;
 	}
 
 	if (ioctl(uart_fd, HCIUARTSETPROTO, proto) < 0) {
 		fprintf(stderr, "Can't set hci protocol\n");
+		notify_failed("Can't set hci protocol");
 		return;
 	}
 
-	if (debug) {
+	if (log_debug()) {
 		fprintf(stderr, "Done setting line discpline\n");
 	}
 
+	/* Ready means the kernel has the device, not merely the ioctls. */
+	int dev_id = notify_hci_registered(uart_fd, mon, NOTIFY_TIMEOUT);
+
+	if (mon != -1) {
+		close(mon);
+	}
+
+	if (dev_id < 0) {
+		fprintf(stderr, "No hci device registered\n");
+		notify_failed("No hci device registered");
+		return;
+	}
+
+	snprintf(name, sizeof(name), "hci%d", dev_id);
+	notify_ready(name);
 	return;
 }
 
@@ -825,7 +1075,7 @@ read_default_bdaddr()
 		return;
 	}
 
-	if (debug) {
+	if (log_debug()) {
 		printf("Read default bdaddr of %s\n", bdaddr);
 	}
 
@@ -848,7 +1098,7 @@ proc_slip_sync()
 	while (!ret) {
 		count = read(uart_fd, buffer, sizeof(slip_sync));
 
-		if (debug) {
+		if (log_debug()) {
 			fprintf(stderr, "received slip sync %d\n", count);
 			dump(buffer, count);
 		}
@@ -879,7 +1129,7 @@ proc_slip_config()
 	while (!ret) {
 		count = read(uart_fd, buffer, sizeof(slip_config_response));
 
-		if (debug) {
+		if (log_debug()) {
 			fprintf(stderr, "received slip config %d\n", count);
 			dump(buffer, count);
 		}
@@ -902,6 +1152,32 @@ proc_slip_config()
 	return(ret);
 }
 
+/* Run one step of the session, timed for --trace and --metrics. */
+static void
+phase(const char *name, void (*proc)())
+{
+	uint64_t start = monotonic_us();
+
+	flightrec_state(name);
+	proc();
+	metrics_phase(name, monotonic_us() - start);
+	trace_span("phase", name, start, monotonic_us(), -1);
+}
+
+/* One child per uart for --probe.  The H4 commands go out before any
+   H5 link exists, as they do when patching. */
+static int
+probe_uart(char *path, struct brcm_inventory *inv)
+{
+	if ((uart_fd = open(path, O_RDWR | O_NOCTTY)) == -1) {
+		snprintf(inv->error, sizeof(inv->error), "%s", strerror(errno));
+		return -1;
+	}
+
+	init_uart();
+	return uart_inventory(uart_fd, inv);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -913,45 +1189,79 @@ main (int argc, char **argv)
 		exit(1);
 	}
 
+	flightrec_init("brcm_patchram_plus_h5", flightrec_path);
+
+	if (probe_only) {
+		if (optind == argc) {
+			fprintf(stderr, "--probe needs at least one uart\n");
+			exit(2);
+		}
+
+		exit(inventory_run(&argv[optind], argc - optind, probe_deadline, probe_uart) ? 1 : 0);
+	}
+
 	if (uart_fd < 0) {
 		exit(2);
 	}
 
+	if (background) {
+		notify_background();
+	}
+
+	/* Only now, so that neither --background nor --probe forks with
+	   the writer running. */
+	if (btsnoop_start() == -1) {
+		fprintf(stderr, "btsnoop capture could not be started\n");
+		exit(1);
+	}
+
 	init_uart();
+	uart_get_icount(uart_fd, &icount_start);
 
-	proc_reset();
+	phase("reset", proc_reset);
+
+	if (!no_quirks && (hcdfile_fd > 0 || baudrate)) {
+		phase("quirks", proc_quirks);
+	}
+
+	phase("flow control", proc_flow_control);
 
 	if (use_baudrate_for_download) {
-		if (termios_baudrate) {
-			proc_baudrate();
+		if (baudrate) {
+			phase("baudrate", proc_baudrate);
 		}
 	}
 
 	if (hcdfile_fd > 0) {
-		proc_patchram();
+		phase("patchram", proc_patchram);
 	}
 
-	if (termios_baudrate) {
-		proc_baudrate();
+	if (baudrate) {
+		phase("baudrate", proc_baudrate);
 	}
 
 	if (bdaddr_flag) {
-		proc_bdaddr();
+		phase("bdaddr", proc_bdaddr);
 	}
 
 	if (enable_lpm) {
-		proc_enable_lpm();
+		phase("lpm", proc_enable_lpm);
 	}
 
 	if (scopcm) {
-		proc_scopcm();
+		phase("scopcm", proc_scopcm);
 	}
 
 	if (i2s) {
-		proc_i2s();
+		phase("i2s", proc_i2s);
+	}
+
+	if (log_debug()) {
+		uart_report_icount(uart_fd, &icount_start);
 	}
 
 	if (enable_h5) {
+		uint64_t start = monotonic_us();
 		time_t t;
 
 		time(&t);
@@ -962,6 +1272,8 @@ main (int argc, char **argv)
 		}
 
 		proc_slip_config();
+		metrics_phase("h5 link setup", monotonic_us() - start);
+		trace_span("phase", "h5 link setup", start, monotonic_us(), -1);
 
 		time(&t);
 		fprintf(stderr, "end %s\n", ctime(&t));
@@ -972,6 +1284,11 @@ main (int argc, char **argv)
 		exit(1);
 	}
 
+	metrics_close(1);
+	trace_close();
+	btsnoop_close();
+	flightrec_done();
+
 	if (enable_h4 || enable_h5) {
 
 		if (enable_h5) {
@@ -979,7 +1296,7 @@ main (int argc, char **argv)
 			tcgetattr(uart_fd, &termios);
 			termios.c_iflag |= (IXON | IXOFF);
 			termios.c_lflag |= ICANON;
-			tcsetattr(uart_fd, TCSANOW, &termios);
+			uart_apply_termios(uart_fd, &termios);
 		}
 
 		proc_enable_hci();
@@ -989,5 +1306,6 @@ main (int argc, char **argv)
 		}
 	}
 
+	notify_ready(argv[optind]);
 	exit(0);
 }
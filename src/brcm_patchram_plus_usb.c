@@ -32,6 +32,8 @@
  *     --debug - Print a debug log
  *     --patchram <patchram_file>
  *			--bd_addr <bd_address>
+ *			--flightrec <file>
+ *			--probe[=<msec>]
  *		  bluez_device_name
  *
  *  Example:
@@ -39,6 +41,10 @@
  *    brcm_patchram_plus --debug \
  *         --patchram BCM2045B2_002.002.011.0348.0349.hcd hci0
  *
+ *    --probe patches nothing: it asks every device given, or every one
+ *    that is up, for its chip id, firmware version and bdaddr, all at
+ *    once, and prints a line of JSON per device.
+ *
  *    It will return 0 for success and a number
  *    greater than 0 for any errors.
  *
@@ -69,6 +75,8 @@
 
 
 #include "brcm_usb.h"
+#include "flightrec.h"
+#include "inventory.h"
 
 #ifdef ANDROID
 # include <cutils/properties.h>
@@ -119,6 +127,10 @@ test_patchram_filename(const char *hcdpath)
  * address isn't parsable and 0 if it succeeds.
  */
 
+static char *flightrec_path;
+static int probe_only = 0;
+static int probe_deadline = INVENTORY_DEADLINE;
+
 static int
 parse_cmd_line(int argc, char *argv[], char ** restrict patchram_path, char ** restrict hci_device, char ** restrict bdaddr)
 {
@@ -130,13 +142,15 @@ parse_cmd_line(int argc, char *argv[], char ** restrict patchram_path, char ** r
 		{"patchram",	1,	NULL, 'p'},
 		{"bd_addr",		1, 	NULL, 'b'},
 		{"debug",			0,	NULL, 'd'},
+		{"flightrec",	1,	NULL, 'r'},
+		{"probe",			2,	NULL, 'P'},
 		{"help",			0,	NULL, 'h'},
 		{0,						0,	0,		0}
 	};
 
 	/* Handle command line arguments. */
 	int arg, option_index = 0;
-	while ((arg = getopt_long(argc, argv, "p:b:dh", long_options, &option_index)) != -1) {
+	while ((arg = getopt_long(argc, argv, "p:b:dr:P::h", long_options, &option_index)) != -1) {
 		switch (arg) {
 	    case 'p':
 				/* --patchram or -p */
@@ -153,6 +167,20 @@ parse_cmd_line(int argc, char *argv[], char ** restrict patchram_path, char ** r
 				debug = 1;
 				break;
 
+			case 'r':
+				/* --flightrec or -r */
+				flightrec_path = optarg;
+				break;
+
+			case 'P':
+				/* --probe or -P */
+				probe_only = 1;
+				if (optarg)
+					probe_deadline = atoi(optarg);
+				if (probe_deadline <= 0)
+					brcm_error(1, "error: --probe needs a deadline in milliseconds\n");
+				break;
+
 	    case '?':
 	    case 'h':
 			default:
@@ -160,7 +188,10 @@ parse_cmd_line(int argc, char *argv[], char ** restrict patchram_path, char ** r
 				printf("\t--debug - Print a debug log\n");
 				printf("\t--patchram patchram_file\n");
 				printf("\t--bd_addr bd_address\n");
-				printf("\t[bluez_device_name]\n");
+				printf("\t--flightrec file - where the last packets go on a failure\n");
+				printf("\t--probe[=msec] - patch nothing, report the chip, firmware and\n");
+				printf("\t\tbdaddr of every device as JSON, within msec (default %d)\n", INVENTORY_DEADLINE);
+				printf("\t[bluez_device_name...]\n");
 				break;
 		}
 	}
@@ -209,13 +240,51 @@ read_default_bdaddr()
 		return;
 	}
 
-	if (debug)
+	if (log_debug())
 		printf("Read default bdaddr of %s\n", bdaddr);
 
 	parse_bdaddr(bdaddr);
 }
 #endif
 
+struct probe_devices {
+	char	*names[HCI_MAX_DEV];
+	char	storage[HCI_MAX_DEV][8];
+	int		count;
+};
+
+/* Callback for brcm_hci_for_each_dev() that collects every device
+   for --probe. */
+static int
+probe_add(int s __attribute__ ((unused)), int dev_id, void *context)
+{
+	struct probe_devices *d = context;
+
+	if (d->count < HCI_MAX_DEV) {
+		snprintf(d->storage[d->count], sizeof(d->storage[0]), "hci%d", dev_id);
+		d->names[d->count] = d->storage[d->count];
+		d->count++;
+	}
+
+	return 0;
+}
+
+static int
+proc_probe(int argc, char *argv[])
+{
+	struct probe_devices d = { .count = 0 };
+
+	if (optind < argc)
+		return inventory_run(&argv[optind], argc - optind, probe_deadline, brcm_probe_usb) ? 1 : 0;
+
+	brcm_hci_for_each_dev(HCI_UP, probe_add, &d);
+
+	if (d.count == 0)
+		brcm_error(2, "error: Could not find any bluetooth devices.\n");
+
+	return inventory_run(d.names, d.count, probe_deadline, brcm_probe_usb) ? 1 : 0;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -226,6 +295,10 @@ main (int argc, char *argv[])
 	char *patchram_path = NULL, *hci_device = NULL, *bdaddr = NULL;
 
 	parse_cmd_line(argc, argv, &patchram_path, &hci_device, &bdaddr);
+	flightrec_init("brcm_patchram_plus_usb", flightrec_path);
+
+	if (probe_only)
+		exit(proc_probe(argc, argv));
 
 	if (patchram_path == NULL)
 		brcm_error(0, "You must supply a patch RAM file with --patchram.\n");
@@ -240,11 +313,12 @@ main (int argc, char *argv[])
 
 	int hcifd = brcm_patchram_usb_init(hci_device);
 
-	if (hcdfd > 0)
-		brcm_patchram_usb(hcifd, hcdfd);
+	if (hcdfd > 0 && brcm_patchram_usb(hcifd, hcdfd) < 0)
+		brcm_error(6, "error: patchram download to %s failed\n", hci_device ? hci_device : "hci device");
 
 	if (bdaddr != NULL)
 		brcm_set_bdaddr_usb(hcifd, bdaddr);
 
+	flightrec_done();
 	exit(0);
 }
@@ -0,0 +1,334 @@
+/*
+ *  brcm_replay.c
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ *  Name: brcm_replay.c
+ *
+ *  Description:
+ *
+ *   Stand-in for a UART controller that plays back a session recorded
+ *   with brcm_patchram_plus --record.  It creates a pty, waits for the
+ *   bytes the host sent in the recording and answers with what the
+ *   controller sent, after the same delay, so a capture from a board in
+ *   the field becomes a repeatable benchmark or regression test.
+ *
+ *   It can be invoked from the command line in the form:
+ *
+ *     --scale <factor>  - multiply the recorded delays, 0 answers at once
+ *                         (default 1)
+ *     --timeout <msec>  - how long to wait for the host (default 5000)
+ *     --link <path>     - symlink to the pty, for scripts
+ *     --debug           - dump every packet
+ *     session_file
+ *
+ *  Example:
+ *
+ *    brcm_patchram_plus --record board7.ses --patchram fw.hcd /dev/ttyS1
+ *    brcm_replay --link /tmp/board7 board7.ses &
+ *    brcm_patchram_plus --patchram fw.hcd /tmp/board7
+ *
+ *  The pty name is printed on stdout once it is ready, and a summary on
+ *  stderr at the end.  It exits with 0 if the host sent exactly what was
+ *  recorded, 1 if it sent something else, 2 if the session file is not
+ *  one or is cut short, and 3 if the host went quiet.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+
+#include "dump.h"
+#include "session.h"
+
+int debug = 0;
+
+struct settings {
+	double			scale;
+	int					timeout;
+	const char	*link;
+} settings = { 1.0, 5000, NULL };
+
+struct replay {
+	int				master;
+	int				slave;					/* ours, until the host has opened it. */
+	unsigned	records;
+	unsigned	mismatches;
+	size_t		sent;
+	size_t		received;
+	struct timespec	clock;			/* when the last record happened here. */
+};
+
+static void
+advance(struct timespec *ts, uint64_t us)
+{
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (us % 1000000) * 1000;
+
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static double
+elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Open a pty in raw mode.  We hold the slave open until the host has
+   it, so the master does not see a hangup before the host starts. */
+static int
+open_pty(struct replay *r, char *name, size_t size)
+{
+	struct termios t;
+
+	r->master = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (r->master == -1 || grantpt(r->master) == -1 || unlockpt(r->master) == -1)
+		return -1;
+
+	snprintf(name, size, "%s", ptsname(r->master));
+
+	r->slave = open(name, O_RDWR | O_NOCTTY);
+
+	if (r->slave == -1 || tcgetattr(r->slave, &t) == -1)
+		return -1;
+
+	cfmakeraw(&t);
+	return tcsetattr(r->slave, TCSANOW, &t);
+}
+
+/* Closing the master throws away whatever the host has not read yet,
+   so wait for it to let go of the pty first. */
+static void
+wait_for_hangup(struct replay *r)
+{
+	struct pollfd pfd = { .fd = r->master, .events = POLLIN };
+	uint8_t discard[256];
+
+	while (poll(&pfd, 1, settings.timeout) > 0 && !(pfd.revents & POLLHUP)) {
+		if (read(r->master, discard, sizeof(discard)) <= 0)
+			break;
+	}
+}
+
+/* Take the bytes the host sent in the recording and check them. */
+static int
+expect_host(struct replay *r, const struct session_record *rec)
+{
+	uint8_t got[SESSION_MAX_DATA];
+	struct pollfd pfd = { .fd = r->master, .events = POLLIN };
+	size_t have = 0;
+
+	while (have < rec->len) {
+		int ready = poll(&pfd, 1, settings.timeout);
+
+		if (ready == -1 && errno == EINTR)
+			continue;
+
+		if (ready <= 0)
+			return -1;
+
+		ssize_t n = read(r->master, &got[have], rec->len - have);
+
+		if (n <= 0)
+			return -1;
+
+		have += n;
+	}
+
+	if (log_debug()) {
+		fprintf(stderr, "record %u: host\n", r->records);
+		dump(got, have);
+	}
+
+	if (memcmp(got, rec->data, rec->len) != 0) {
+		r->mismatches++;
+		fprintf(stderr, "record %u: host sent something else, expected\n", r->records);
+		dump(rec->data, rec->len);
+	}
+
+	if (r->slave != -1) {
+		close(r->slave);
+		r->slave = -1;
+	}
+
+	r->sent += have;
+	clock_gettime(CLOCK_MONOTONIC, &r->clock);
+	return 0;
+}
+
+/* Answer as the controller did, delta after the previous record. */
+static void
+answer(struct replay *r, const struct session_record *rec)
+{
+	advance(&r->clock, rec->delta_us * settings.scale);
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &r->clock, NULL) == EINTR)
+		;
+
+	if (log_debug()) {
+		fprintf(stderr, "record %u: controller\n", r->records);
+		dump(rec->data, rec->len);
+	}
+
+	if (write(r->master, rec->data, rec->len) != (ssize_t)rec->len)
+		fprintf(stderr, "record %u: write: %s\n", r->records, strerror(errno));
+
+	r->received += rec->len;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"scale",		1,	NULL, 's'},
+		{"timeout",	1,	NULL, 't'},
+		{"link",		1,	NULL, 'l'},
+		{"debug",		0,	NULL, 'd'},
+		{"help",		0,	NULL, 'h'},
+		{0,					0,	0,		0}
+	};
+
+	int arg, option_index = 0;
+	while ((arg = getopt_long(argc, argv, "s:t:l:dh", long_options, &option_index)) != -1) {
+		switch (arg) {
+			case 's':
+				settings.scale = strtod(optarg, NULL);
+				break;
+
+			case 't':
+				settings.timeout = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'l':
+				settings.link = optarg;
+				break;
+
+			case 'd':
+				debug = 1;
+				break;
+
+			case '?':
+			case 'h':
+			default:
+				printf("Usage %s:\n", argv[0]);
+				printf("\t--scale factor - multiply the recorded delays\n");
+				printf("\t--timeout msec - how long to wait for the host\n");
+				printf("\t--link path - symlink to the pty\n");
+				printf("\t--debug - Print a debug log\n");
+				printf("\tsession_file\n");
+				exit(0);
+		}
+	}
+
+	if (optind != argc - 1 || settings.scale < 0) {
+		fprintf(stderr, "usage: %s [--scale factor] [--timeout msec] [--link path] session_file\n", argv[0]);
+		exit(1);
+	}
+
+	FILE *in = fopen(argv[optind], "r");
+
+	if (in == NULL || session_read_header(in) == -1) {
+		fprintf(stderr, "%s is not a recorded session\n", argv[optind]);
+		exit(2);
+	}
+
+	struct replay r = { .master = -1, .slave = -1 };
+	char name[64];
+
+	if (open_pty(&r, name, sizeof(name)) == -1) {
+		fprintf(stderr, "could not create a pty: %s\n", strerror(errno));
+		exit(2);
+	}
+
+	if (settings.link) {
+		unlink(settings.link);
+
+		if (symlink(name, settings.link) == -1) {
+			fprintf(stderr, "could not link %s: %s\n", settings.link, strerror(errno));
+			exit(2);
+		}
+	}
+
+	printf("%s\n", name);
+	fflush(stdout);
+
+	struct session_record rec;
+	struct timespec start;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &r.clock);
+	start = r.clock;
+
+	/* The clock starts with the first bytes from the host. */
+	while ((ret = session_read(in, &rec)) == 1) {
+		if (rec.type == SESSION_SENT) {
+			if (expect_host(&r, &rec) == -1) {
+				fprintf(stderr, "record %u: the host went quiet\n", r.records);
+				exit(3);
+			}
+
+			if (r.records == 0) {
+				start = r.clock;
+			}
+		} else if (rec.type == SESSION_RECEIVED) {
+			answer(&r, &rec);
+		} else {
+			/* The host changed its own side; only the time passes. */
+			advance(&r.clock, rec.delta_us * settings.scale);
+
+			if (log_debug()) {
+				fprintf(stderr, "record %u: %u baud\n", r.records, rec.len);
+			}
+		}
+
+		r.records++;
+	}
+
+	if (ret == -1) {
+		fprintf(stderr, "session file truncated after %u records\n", r.records);
+	}
+
+	wait_for_hangup(&r);
+
+	fprintf(stderr, "replayed %u records, %zu bytes from the host, %zu to it, "
+		"%u mismatches, %.1f ms\n", r.records, r.sent, r.received, r.mismatches,
+		elapsed_ms(&start));
+
+	if (settings.link) {
+		unlink(settings.link);
+	}
+
+	/* A damaged capture proves nothing, however well the host did. */
+	if (ret == -1) {
+		return 2;
+	}
+
+	return r.mismatches ? 1 : 0;
+}
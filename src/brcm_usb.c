@@ -3,6 +3,7 @@
 #include <stdlib.h>			/* for malloc() and free() */
 #include <sys/ioctl.h>	/* for ioctl() */
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -19,20 +20,14 @@
 #include <bluetooth/hci_lib.h>
 
 #include "brcm_usb.h"
+#include "flightrec.h"
+#include "inventory.h"
+#include "probes.h"
 
 int debug = 0;
 
 /* utility routines we want to expose. */
 
-/* FIXME: Will probably move dump to another module. */
-void
-dump(const uint8_t *out, ssize_t len)
-{
-	for (ssize_t i = 0; i < len; i++)
-		fprintf(stderr, "%02x%s", out[i], ((i+1) % 16) ? " " : "\n");
-	fprintf(stderr, "\n");
-}
-
 int
 brcm_hci_for_each_dev(int flag, int (*func)(int s, int dev_id, void *context), void *context)
 {
@@ -70,45 +65,217 @@ done:
 	return dev_id;
 }
 
+/* Wait up to timeout milliseconds for a single event.  Returns the
+   number of bytes read, 0 on timeout and -1 on error. */
 static ssize_t
-read_event(int fd, uint8_t *buffer)
+read_event(int fd, uint8_t *buffer, int timeout)
 {
-	ssize_t bytesin = read(fd, buffer, 260);
-	hexdump(buffer, bytesin, "received %zd\n", bytesin);
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int ready;
+
+	while ((ready = poll(&pfd, 1, timeout)) == -1 && errno == EINTR)
+		;
+
+	if (ready <= 0)
+		return ready;
+
+	ssize_t bytesin = read(fd, buffer, HCI_MAX_EVENT_SIZE);
+
+	if (bytesin > 0) {
+		hexdump(buffer, bytesin, "received %zd\n", bytesin);
+		flightrec_packet(buffer, bytesin, 1);
+		probe_event(buffer, bytesin);
+	}
+
 	return bytesin;
 }
 
 int
 brcm_hci_send_cmd(int sock, uint16_t cmd, uint8_t plen, void *param)
 {
-	uint16_t	ogf = cmd >> 8,
-						ocf = cmd & 0x00ff;
+	uint16_t	ogf = cmd_opcode_ogf(cmd),
+						ocf = cmd_opcode_ocf(cmd);
 
 	hexdump(param, plen,
 		"Sending: 0x%x (0x%0x, 0x%0x)\n",
 		cmd, ogf, ocf);
 
+	flightrec_command(cmd, param, plen);
+	PROBE2(cmd_send, cmd, plen);
 	return hci_send_cmd(sock, ogf, ocf, plen, param);
 }
 
+/*
+ * Commands are pipelined: we keep sending until either the controller
+ * runs out of command credits (Num_HCI_Command_Packets in the last
+ * Command Complete/Status) or BRCM_USB_WINDOW commands are outstanding.
+ * Each completion is matched against the oldest outstanding command
+ * with the same opcode, so stray events can no longer be mistaken for
+ * the completion of whatever we sent last.
+ */
+#define BRCM_USB_WINDOW		8
+#define BRCM_USB_TIMEOUT	2000	/* milliseconds */
+
+struct brcm_cmd_window {
+	uint16_t	opcode[BRCM_USB_WINDOW];	/* outstanding, oldest first. */
+	int32_t		offset[BRCM_USB_WINDOW];	/* of their HCD records, or -1. */
+	int32_t		record;										/* offset of the next one queued. */
+	unsigned	count;
+	unsigned	credits;
+	uint16_t	filter;										/* opcode the socket filter passes. */
+};
+
+/* Narrow the socket filter to Command Complete/Status events for a
+   single opcode so unrelated traffic never wakes us up.  Returns -1 if
+   the old filter is still in place. */
+static int
+set_cmd_filter(int hcifd, struct brcm_cmd_window *w, uint16_t opcode)
+{
+	struct hci_filter flt;
+	hci_filter_clear(&flt);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+	hci_filter_set_event(EVT_CMD_COMPLETE, &flt);
+	hci_filter_set_event(EVT_CMD_STATUS, &flt);
+	hci_filter_set_opcode(htobs(opcode), &flt);
+
+	if (setsockopt(hcifd, SOL_HCI, HCI_FILTER, &flt, sizeof (flt)) < 0) {
+		fprintf(stderr, "error: could not filter for 0x%04x (%s)\n", opcode, strerror(errno));
+		return -1;
+	}
+
+	w->filter = opcode;
+	return 0;
+}
+
+/* Wait for one completion and retire the command it belongs to.
+   Returns 1 if a command was retired, 0 if the event did not match
+   anything we sent and -1 on timeout or a failed command. */
+static int
+wait_cmd_complete(int hcifd, struct brcm_cmd_window *w)
+{
+	uint8_t buffer[HCI_MAX_EVENT_SIZE];
+	ssize_t len = read_event(hcifd, buffer, BRCM_USB_TIMEOUT);
+
+	if (len <= 0) {
+		flightrec_failed("timeout");
+		fprintf(stderr, "error: timed out waiting for 0x%04x (%u outstanding)\n",
+			w->count ? w->opcode[0] : 0, w->count);
+		return -1;
+	}
+
+	if (len < 1 + HCI_EVENT_HDR_SIZE || buffer[0] != HCI_EVENT_PKT)
+		return 0;
+
+	hci_event_hdr *hdr = (void *)&buffer[1];
+	uint8_t *params = &buffer[1 + HCI_EVENT_HDR_SIZE];
+	uint16_t opcode;
+	uint8_t ncmd, status;
+
+	if (hdr->evt == EVT_CMD_COMPLETE && hdr->plen >= EVT_CMD_COMPLETE_SIZE) {
+		evt_cmd_complete *cc = (void *)params;
+		ncmd = cc->ncmd;
+		opcode = btohs(cc->opcode);
+		status = hdr->plen > EVT_CMD_COMPLETE_SIZE ? params[EVT_CMD_COMPLETE_SIZE] : 0;
+	} else if (hdr->evt == EVT_CMD_STATUS && hdr->plen >= EVT_CMD_STATUS_SIZE) {
+		evt_cmd_status *cs = (void *)params;
+		ncmd = cs->ncmd;
+		opcode = btohs(cs->opcode);
+		status = cs->status;
+	} else {
+		return 0;
+	}
+
+	w->credits = ncmd;
+
+	unsigned i;
+	for (i = 0; i < w->count && w->opcode[i] != opcode; i++)
+		;
+
+	if (i == w->count)
+		return 0;
+
+	if (w->offset[i] != -1)
+		PROBE2(record_end, w->offset[i], status);
+
+	w->count--;
+	for (; i < w->count; i++) {
+		w->opcode[i] = w->opcode[i + 1];
+		w->offset[i] = w->offset[i + 1];
+	}
+
+	if (status) {
+		fprintf(stderr, "error: command 0x%04x failed with status 0x%02x\n", opcode, status);
+		return -1;
+	}
+
+	return 1;
+}
+
+static int
+drain_cmd_window(int hcifd, struct brcm_cmd_window *w)
+{
+	while (w->count > 0)
+		if (wait_cmd_complete(hcifd, w) < 0)
+			return -1;
+
+	return 0;
+}
+
+/* Queue a command, blocking only while the window is full or the
+   controller has no credits left. */
+static int
+send_cmd_windowed(int hcifd, struct brcm_cmd_window *w, uint16_t opcode, uint8_t plen, void *param)
+{
+	/* The kernel filter only passes one opcode at a time, so drain
+		 before switching to a different command. */
+	if (opcode != w->filter) {
+		if (drain_cmd_window(hcifd, w) < 0 || set_cmd_filter(hcifd, w, opcode) < 0)
+			return -1;
+	}
+
+	while (w->count == BRCM_USB_WINDOW || (w->count > 0 && w->credits == 0))
+		if (wait_cmd_complete(hcifd, w) < 0)
+			return -1;
+
+	if (w->record != -1)
+		PROBE2(record_start, w->record, opcode);
+
+	if (brcm_hci_send_cmd(hcifd, opcode, plen, param) < 0)
+		return -1;
+
+	w->offset[w->count] = w->record;
+	w->opcode[w->count++] = opcode;
+	if (w->credits > 0)
+		w->credits--;
+
+	return 0;
+}
+
+/* Send a single command and wait for its completion. */
+static int
+send_cmd_sync(int hcifd, struct brcm_cmd_window *w, uint16_t opcode, uint8_t plen, void *param)
+{
+	if (send_cmd_windowed(hcifd, w, opcode, plen, param) < 0)
+		return -1;
+
+	return drain_cmd_window(hcifd, w);
+}
+
 #define BRCM_HCI_OP_RESET 0x0c03
-static void
-proc_reset(int hcifd)
+static int
+proc_reset(int hcifd, struct brcm_cmd_window *w)
 {
-	uint8_t buffer[1024];
 	for (unsigned try = 0; try < 5; try++) {
-		brcm_hci_send_cmd(hcifd, BRCM_HCI_OP_RESET, 0, NULL);
-			
-		/* Wait 4 seconds for descriptor to be readable. */ 
-		struct pollfd pfd = { .fd = hcifd, .events = POLLIN };
-		/* FIXME: We should probably catch EINTR here or use ppoll(). */
-		int ready = poll(&pfd, 1, 4 * 1000);
-
-		if (ready == 1) {
-			read_event(hcifd, buffer);
-			break;
-		}
+		/* Forget whatever was outstanding when the last try timed out. */
+		w->count = 0;
+		w->credits = 1;
+		PROBE0(reset);
+
+		if (send_cmd_sync(hcifd, w, BRCM_HCI_OP_RESET, 0, NULL) == 0)
+			return 0;
 	}
+
+	return -1;
 }
 
 /* patch related routines we want to expose. */
@@ -127,12 +294,82 @@ brcm_set_bdaddr_usb(int hcifd, const char *bdaddr_string)
 	for (unsigned i = 0; i < 6; i++)
 		bdaddr[i] = bd_addr[i];
 
-	brcm_hci_send_cmd(hcifd, BRCM_SET_BDADDR, 6, bdaddr);
+	struct brcm_cmd_window w = { .credits = 1, .record = -1 };
+	return send_cmd_sync(hcifd, &w, BRCM_SET_BDADDR, 6, bdaddr);
+}
+
+/* Send a command without parameters and hand the return parameters
+   of its Command Complete to inv. */
+static int
+probe_cmd(int hcifd, uint16_t opcode, struct brcm_inventory *inv)
+{
+	struct brcm_cmd_window w = { .credits = 1, .record = -1 };
+	uint8_t buffer[HCI_MAX_EVENT_SIZE];
+	ssize_t len;
+
+	if (set_cmd_filter(hcifd, &w, opcode) < 0) {
+		inventory_fail(inv, opcode, "no event filter");
+		return -1;
+	}
 
-	uint8_t buffer[1024];
-	read_event(hcifd, buffer);
+	if (brcm_hci_send_cmd(hcifd, opcode, 0, NULL) < 0) {
+		inventory_fail(inv, opcode, strerror(errno));
+		return -1;
+	}
 
-	return 0;
+	/* The filter lets only this opcode's Command Complete/Status in from
+	   now on, but a late answer to the previous command may already be
+	   queued, so check the opcode of both. */
+	while ((len = read_event(hcifd, buffer, INVENTORY_TIMEOUT)) > 0) {
+		if (len < 1 + HCI_EVENT_HDR_SIZE || buffer[0] != HCI_EVENT_PKT)
+			continue;
+
+		hci_event_hdr *hdr = (void *)&buffer[1];
+		uint8_t *params = &buffer[1 + HCI_EVENT_HDR_SIZE];
+
+		if (hdr->evt == EVT_CMD_STATUS && hdr->plen >= EVT_CMD_STATUS_SIZE) {
+			evt_cmd_status *cs = (void *)params;
+
+			if (btohs(cs->opcode) == opcode && cs->status)
+				return inventory_complete(inv, opcode, &cs->status, 1);
+		} else if (hdr->evt == EVT_CMD_COMPLETE && hdr->plen >= EVT_CMD_COMPLETE_SIZE) {
+			evt_cmd_complete *cc = (void *)params;
+
+			if (btohs(cc->opcode) == opcode)
+				return inventory_complete(inv, opcode, &params[EVT_CMD_COMPLETE_SIZE],
+					hdr->plen - EVT_CMD_COMPLETE_SIZE);
+		}
+	}
+
+	inventory_fail(inv, opcode, "timeout");
+	return -1;
+}
+
+/* What --probe asks a controller: nothing that changes its state
+   beyond the reset.  Returns 0 if all of it answered. */
+int
+brcm_probe_usb(char *hci_device, struct brcm_inventory *inv)
+{
+	int dev_id = hci_devid(hci_device);
+	int hcifd = dev_id < 0 ? -1 : hci_open_dev(dev_id);
+
+	if (hcifd == -1) {
+		snprintf(inv->error, sizeof(inv->error), "%s", dev_id < 0 ? "no such device" : strerror(errno));
+		return -1;
+	}
+
+	if (probe_cmd(hcifd, INVENTORY_OP_RESET, inv) != 0) {
+		close(hcifd);
+		return -1;
+	}
+
+	/* Carry on past a failure: whatever else answers is still news. */
+	int ret = probe_cmd(hcifd, INVENTORY_OP_VERBOSE_CONFIG, inv);
+	ret |= probe_cmd(hcifd, INVENTORY_OP_LOCAL_VERSION, inv);
+	ret |= probe_cmd(hcifd, INVENTORY_OP_BDADDR, inv);
+
+	close(hcifd);
+	return ret;
 }
 
 /* Callback for hci brcm_hci_for_each_dev() that prints the available
@@ -208,46 +445,65 @@ brcm_patchram_usb_init(const char *hci_device)
 		return -1;
 		/* brcm_error(2, "device %s could not be found\n", argv[optind]); */
 
+	/* Until the first command goes out we only care about
+		 completions; the command window narrows this per opcode. */
 	struct hci_filter flt;
 	hci_filter_clear(&flt);
 	hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
-	hci_filter_all_events(&flt);
+	hci_filter_set_event(EVT_CMD_COMPLETE, &flt);
+	hci_filter_set_event(EVT_CMD_STATUS, &flt);
 	setsockopt(hcifd, SOL_HCI, HCI_FILTER, &flt, sizeof (flt));
 
 	return hcifd;
 }
 
 #define BRCM_HCI_DOWNLOAD_MINIDRIVER 0xfc2e
-/* FIXME: This should return something useful.  Perhaps bytes written? */
-void
+/* Returns 0 on success and -1 if the controller stopped answering or
+   rejected one of the commands. */
+int
 brcm_patchram_usb(int hcifd, int hcdfd /* readable descriptor for patchram file. */)
 {
-	uint8_t buffer[1024];
+	struct brcm_cmd_window w = { .credits = 1, .record = -1 };
+	int32_t offset = 0;
+
+	flightrec_state("reset");
 
-	proc_reset(hcifd);
+	if (proc_reset(hcifd, &w) < 0)
+		return -1;
 
-	brcm_hci_send_cmd(hcifd, BRCM_HCI_DOWNLOAD_MINIDRIVER, 0, NULL);
+	flightrec_state("minidriver");
 
-	read_event(hcifd, buffer);
+	if (send_cmd_sync(hcifd, &w, BRCM_HCI_DOWNLOAD_MINIDRIVER, 0, NULL) < 0)
+		return -1;
 
 	/* FIXME: Why sleep here?  Does the driver require a pause after
 		 sending the HCIDownloadMinidriver command?  */
 	sleep(1);
 
+	flightrec_state("download");
+
 	hci_command_hdr hci_command;
 	while (read(hcdfd, &hci_command, sizeof (hci_command)) > 0) {
 		uint8_t payload[hci_command.plen];
 		ssize_t bytesin = read(hcdfd, payload, sizeof (payload));
 
 		if (bytesin > 0) {
-			hci_command.opcode = htons(hci_command.opcode);
-			brcm_hci_send_cmd(hcifd, hci_command.opcode, hci_command.plen, payload);
-			read_event(hcifd, buffer);
+			w.record = offset;
+
+			if (send_cmd_windowed(hcifd, &w, btohs(hci_command.opcode), hci_command.plen, payload) < 0)
+				return -1;
+
+			w.record = -1;
+			offset += sizeof (hci_command) + hci_command.plen;
 		} else {
 			/* FIXME: is it worth while to try to recover from this error? */
 			break;
 		}
 	}
 
-	proc_reset(hcifd);
+	if (drain_cmd_window(hcifd, &w) < 0)
+		return -1;
+
+	flightrec_state("launched");
+	return proc_reset(hcifd, &w);
 }
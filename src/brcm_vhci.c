@@ -0,0 +1,365 @@
+/*
+ *  brcm_vhci.c
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ *  Name: brcm_vhci.c
+ *
+ *  Description:
+ *
+ *   Stand-in for a Broadcom USB controller so brcm_patchram_plus_usb can
+ *   be exercised without hardware.  Each emulated controller is a
+ *   virtual HCI device created through /dev/vhci that answers the
+ *   commands the kernel issues during bring-up plus the Broadcom vendor
+ *   commands used while patching (Download_Minidriver, Write_RAM,
+ *   Launch_RAM, Write_BD_ADDR).
+ *
+ *   It can be invoked from the command line in the form:
+ *
+ *     --count <n>        - number of controllers to create (default 1)
+ *     --latency <usec>   - delay before answering each command
+ *     --chip_id <id>     - chip id reported by verbose config version
+ *     --name <name>      - local name, e.g. BCM20702A0
+ *     --ncmd <n>         - command credits granted by every Command
+ *                          Complete (default 1), to exercise the
+ *                          pipelined download
+ *     --up               - bring the new hci devices up
+ *     --debug            - dump every packet
+ *
+ *  Example:
+ *
+ *    brcm_vhci --count 2 --latency 500 --up &
+ *    brcm_patchram_plus_usb --patchram BCM20702A1.hcd hci1
+ *
+ *  Every controller prints "hciN" on stdout once registered, and a
+ *  summary of the download (records, bytes, elapsed time) when it
+ *  receives Launch_RAM.  The tool runs until it is killed.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "brcm_usb.h"
+
+#define VHCI_DEVICE		"/dev/vhci"
+#define HCI_PRIMARY		0x00
+
+#define BRCM_WRITE_BD_ADDR					0xfc01
+#define BRCM_DOWNLOAD_MINIDRIVER		0xfc2e
+#define BRCM_WRITE_RAM							0xfc4c
+#define BRCM_LAUNCH_RAM							0xfc4e
+#define BRCM_READ_VERBOSE_CONFIG		0xfc79
+
+extern int debug;
+
+struct controller {
+	int				fd;
+	int				index;
+	bool			minidriver;
+	uint8_t		bdaddr[6];
+	unsigned	records;
+	size_t		bytes;
+	struct timespec	start;
+};
+
+struct settings {
+	unsigned	count;
+	useconds_t	latency;
+	uint8_t		chip_id;
+	const char	*name;
+	bool			up;
+	uint8_t		ncmd;
+} settings = { 1, 0, 0x43, "BCM20702A0", false, 1 };
+
+/* Send a Command Complete for opcode with a status byte followed by
+   plen bytes of return parameters. */
+static void
+cmd_complete(struct controller *c, uint16_t opcode, uint8_t status, const void *rparam, uint8_t plen)
+{
+	uint8_t event[HCI_MAX_EVENT_SIZE] = { HCI_EVENT_PKT, EVT_CMD_COMPLETE, EVT_CMD_COMPLETE_SIZE + 1 + plen, settings.ncmd, opcode & 0xff, opcode >> 8, status };
+
+	if (rparam != NULL)
+		memcpy(&event[7], rparam, plen);
+	else
+		memset(&event[7], 0, plen);
+
+	if (settings.latency)
+		usleep(settings.latency);
+
+	hexdump(event, 7 + plen, "hci%d: event\n", c->index);
+
+	if (write(c->fd, event, 7 + plen) < 0)
+		fprintf(stderr, "hci%d: write: %s\n", c->index, strerror(errno));
+}
+
+static double
+elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void
+handle_command(struct controller *c, const uint8_t *pkt, ssize_t len)
+{
+	if (len < 1 + HCI_COMMAND_HDR_SIZE)
+		return;
+
+	uint16_t opcode = pkt[1] | (pkt[2] << 8);
+	uint8_t plen = pkt[3];
+	const uint8_t *param = &pkt[4];
+
+	if (len < 1 + HCI_COMMAND_HDR_SIZE + plen)
+		plen = len - 1 - HCI_COMMAND_HDR_SIZE;
+
+	switch (opcode) {
+		case 0x0c03:	/* Reset */
+			c->minidriver = false;
+			cmd_complete(c, opcode, 0, NULL, 0);
+			break;
+
+		case 0x0c14: {	/* Read Local Name */
+			uint8_t name[248] = { 0 };
+			strncpy((char *)name, settings.name, sizeof (name) - 1);
+			cmd_complete(c, opcode, 0, name, sizeof (name));
+			break;
+		}
+
+		case 0x1001: {	/* Read Local Version Information */
+			uint8_t version[] = { 0x06, 0x00, 0x10, 0x06, 0x0f, 0x00, 0x0e, 0x41 };
+			cmd_complete(c, opcode, 0, version, sizeof (version));
+			break;
+		}
+
+		case 0x1002:	/* Read Local Supported Commands */
+			cmd_complete(c, opcode, 0, NULL, 64);
+			break;
+
+		case 0x1005: {	/* Read Buffer Size */
+			uint8_t size[] = { 0xfd, 0x03, 0x40, 0x08, 0x00, 0x08, 0x00 };
+			cmd_complete(c, opcode, 0, size, sizeof (size));
+			break;
+		}
+
+		case 0x1009:	/* Read BD_ADDR */
+			cmd_complete(c, opcode, 0, c->bdaddr, sizeof (c->bdaddr));
+			break;
+
+		case BRCM_WRITE_BD_ADDR:
+			if (plen == sizeof (c->bdaddr))
+				memcpy(c->bdaddr, param, sizeof (c->bdaddr));
+			cmd_complete(c, opcode, plen == sizeof (c->bdaddr) ? 0 : 0x12, NULL, 0);
+			break;
+
+		case BRCM_READ_VERBOSE_CONFIG: {
+			uint8_t config[] = { settings.chip_id, 0x00, 0x00, 0x00, 0x00, 0x00 };
+			cmd_complete(c, opcode, 0, config, sizeof (config));
+			break;
+		}
+
+		case BRCM_DOWNLOAD_MINIDRIVER:
+			c->minidriver = true;
+			c->records = 0;
+			c->bytes = 0;
+			clock_gettime(CLOCK_MONOTONIC, &c->start);
+			cmd_complete(c, opcode, 0, NULL, 0);
+			break;
+
+		case BRCM_WRITE_RAM:
+			/* Write_RAM is only understood by the minidriver. */
+			if (c->minidriver && plen > 4) {
+				c->records++;
+				c->bytes += plen - 4;
+			}
+			cmd_complete(c, opcode, c->minidriver && plen > 4 ? 0 : 0x0c, NULL, 0);
+			break;
+
+		case BRCM_LAUNCH_RAM:
+			if (c->minidriver)
+				printf("hci%d: %u records, %zu bytes in %.1f ms\n",
+					c->index, c->records, c->bytes, elapsed_ms(&c->start));
+			fflush(stdout);
+			c->minidriver = false;
+			cmd_complete(c, opcode, 0, NULL, 0);
+			break;
+
+		default:
+			/* Everything else the kernel asks for during bring-up gets a
+				 zero-filled reply long enough to satisfy its length checks. */
+			cmd_complete(c, opcode, 0, NULL, 32);
+			break;
+	}
+}
+
+static int
+create_controller(struct controller *c)
+{
+	if ((c->fd = open(VHCI_DEVICE, O_RDWR)) == -1)
+		return -1;
+
+	uint8_t request[] = { HCI_VENDOR_PKT, HCI_PRIMARY };
+	if (write(c->fd, request, sizeof (request)) != sizeof (request))
+		return -1;
+
+	uint8_t response[4];
+	if (read(c->fd, response, sizeof (response)) != sizeof (response) || response[0] != HCI_VENDOR_PKT)
+		return -1;
+
+	c->index = response[2] | (response[3] << 8);
+
+	/* Unique, recognisable address per controller: 00:10:18:00:00:NN. */
+	uint8_t bdaddr[6] = { c->index, 0x00, 0x00, 0x18, 0x10, 0x00 };
+	memcpy(c->bdaddr, bdaddr, sizeof (bdaddr));
+
+	return 0;
+}
+
+/* HCIDEVUP blocks until the kernel has finished talking to the
+   controller, so it has to run beside the command loop. */
+static void
+bring_up(int index)
+{
+	if (fork() != 0)
+		return;
+
+	int ctl = socket(AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+	if (ctl < 0 || ioctl(ctl, HCIDEVUP, index) < 0)
+		fprintf(stderr, "hci%d: could not bring device up: %s\n", index, strerror(errno));
+
+	_exit(0);
+}
+
+static void
+run_controller(void)
+{
+	struct controller c = { .fd = -1 };
+
+	if (create_controller(&c) < 0)
+		brcm_error(2, "could not create virtual controller: %s\n", strerror(errno));
+
+	printf("hci%d\n", c.index);
+	fflush(stdout);
+
+	if (settings.up)
+		bring_up(c.index);
+
+	uint8_t pkt[HCI_MAX_FRAME_SIZE];
+	ssize_t len;
+	while ((len = read(c.fd, pkt, sizeof (pkt))) != 0) {
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			brcm_error(3, "hci%d: read: %s\n", c.index, strerror(errno));
+		}
+
+		hexdump(pkt, len, "hci%d: command\n", c.index);
+
+		if (pkt[0] == HCI_COMMAND_PKT)
+			handle_command(&c, pkt, len);
+	}
+
+	exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"count",		1,	NULL, 'n'},
+		{"latency",	1,	NULL, 'l'},
+		{"chip_id",	1,	NULL, 'c'},
+		{"name",		1,	NULL, 'N'},
+		{"ncmd",		1,	NULL, 'm'},
+		{"up",			0,	NULL, 'u'},
+		{"debug",		0,	NULL, 'd'},
+		{"help",		0,	NULL, 'h'},
+		{0,					0,	0,		0}
+	};
+
+	int arg, option_index = 0;
+	while ((arg = getopt_long(argc, argv, "n:l:c:N:m:udh", long_options, &option_index)) != -1) {
+		switch (arg) {
+			case 'n':
+				settings.count = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'l':
+				settings.latency = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'c':
+				settings.chip_id = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'N':
+				settings.name = optarg;
+				break;
+
+			case 'm':
+				settings.ncmd = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'u':
+				settings.up = true;
+				break;
+
+			case 'd':
+				debug = 1;
+				break;
+
+			case '?':
+			case 'h':
+			default:
+				printf("Usage %s:\n", argv[0]);
+				printf("\t--count n - number of virtual controllers\n");
+				printf("\t--latency usec - delay before each command completes\n");
+				printf("\t--chip_id id\n");
+				printf("\t--name local_name\n");
+				printf("\t--ncmd n - command credits in every Command Complete\n");
+				printf("\t--up - bring the hci devices up\n");
+				printf("\t--debug - Print a debug log\n");
+				exit(0);
+		}
+	}
+
+	/* Reap the bring_up() helpers. */
+	signal(SIGCHLD, SIG_IGN);
+
+	/* One process per controller keeps the latency emulation honest
+		 when adapters are patched in parallel. */
+	for (unsigned i = 1; i < settings.count; i++)
+		if (fork() == 0)
+			run_controller();
+
+	run_controller();
+	return 0;
+}
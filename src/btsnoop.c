@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "btsnoop.h"
+
+/* btsnoop version 1, HCI UART (H4) datalink. */
+#define BTSNOOP_VERSION		1
+#define BTSNOOP_H4				1002
+
+#define BTSNOOP_FLAG_RECEIVED	0x01
+#define BTSNOOP_FLAG_CMD_EVT	0x02
+
+/* Microseconds from 0 AD to the Unix epoch. */
+#define BTSNOOP_EPOCH_DELTA	0x00dcddb30f2f8000ull
+
+struct btsnoop_slot {
+	uint64_t	ts_us;
+	uint16_t	len;
+	uint8_t		flags;
+	uint8_t		data[BTSNOOP_MAX_PACKET];
+};
+
+int btsnoop_enabled = 0;
+
+static struct btsnoop_slot *ring;
+static unsigned head;			/* written by the producer only. */
+static unsigned tail;			/* written by the writer thread only. */
+static unsigned dropped;
+static int stopping;
+static FILE *out;
+static pthread_t writer;
+
+static void
+put_be32(uint8_t *p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, 4);
+}
+
+static void
+write_slot(const struct btsnoop_slot *slot, unsigned drops)
+{
+	uint8_t hdr[24];
+	uint64_t ts = slot->ts_us + BTSNOOP_EPOCH_DELTA;
+
+	put_be32(&hdr[0], slot->len);
+	put_be32(&hdr[4], slot->len);
+	put_be32(&hdr[8], slot->flags);
+	put_be32(&hdr[12], drops);
+	put_be32(&hdr[16], ts >> 32);
+	put_be32(&hdr[20], ts);
+
+	fwrite(hdr, sizeof(hdr), 1, out);
+	fwrite(slot->data, slot->len, 1, out);
+}
+
+static void *
+writer_main(void *arg __attribute__ ((unused)))
+{
+	const struct timespec idle = { 0, 2000000 };
+
+	for (;;) {
+		unsigned h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+
+		if (tail == h) {
+			fflush(out);
+
+			if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE) &&
+					h == __atomic_load_n(&head, __ATOMIC_ACQUIRE))
+				break;
+
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		while (tail != h) {
+			write_slot(&ring[tail % BTSNOOP_SLOTS], __atomic_load_n(&dropped, __ATOMIC_RELAXED));
+			__atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	return NULL;
+}
+
+/* fork() keeps only the calling thread.  Stop the writer first, which
+   leaves the ring empty and the file flushed, so a child has nothing
+   of ours to write out when it exits. */
+static void
+fork_prepare(void)
+{
+	if (!btsnoop_enabled)
+		return;
+
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(writer, NULL);
+	stopping = 0;
+}
+
+static void
+fork_parent(void)
+{
+	if (btsnoop_enabled && pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+		btsnoop_enabled = 0;
+		fclose(out);
+	}
+}
+
+/* The file and its offset are shared with the parent, so a child that
+   wrote to it too would interleave its records with ours. */
+static void
+fork_child(void)
+{
+	btsnoop_enabled = 0;
+}
+
+/* Open path and write the file header.  Nothing is captured until
+   btsnoop_start(), so open early, to report a bad path before anything
+   else happens, and start once the process that will do the work is
+   the one running. */
+int
+btsnoop_open(const char *path)
+{
+	uint8_t hdr[16] = { 'b', 't', 's', 'n', 'o', 'o', 'p', 0 };
+
+	if ((ring = malloc(BTSNOOP_SLOTS * sizeof(*ring))) == NULL)
+		return -1;
+
+	if ((out = fopen(path, "wb")) == NULL) {
+		free(ring);
+		ring = NULL;
+		return -1;
+	}
+
+	put_be32(&hdr[8], BTSNOOP_VERSION);
+	put_be32(&hdr[12], BTSNOOP_H4);
+	fwrite(hdr, sizeof(hdr), 1, out);
+	return 0;
+}
+
+/* Start capturing to the file btsnoop_open() opened.  The file is
+   closed, with everything still in the ring written out, by
+   btsnoop_close() or at exit. */
+int
+btsnoop_start(void)
+{
+	if (out == NULL || btsnoop_enabled)
+		return 0;
+
+	if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+		fclose(out);
+		out = NULL;
+		free(ring);
+		ring = NULL;
+		return -1;
+	}
+
+	btsnoop_enabled = 1;
+	atexit(btsnoop_close);
+	pthread_atfork(fork_prepare, fork_parent, fork_child);
+	return 0;
+}
+
+/* Queue one H4 packet.  Called from the one thread that talks to the
+   controller; costs a clock read and a copy. */
+void
+btsnoop_packet(const uint8_t *data, size_t len, int received)
+{
+	struct timespec now;
+
+	if (!btsnoop_enabled)
+		return;
+
+	if (head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == BTSNOOP_SLOTS) {
+		__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct btsnoop_slot *slot = &ring[head % BTSNOOP_SLOTS];
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	slot->ts_us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	slot->len = len < BTSNOOP_MAX_PACKET ? len : BTSNOOP_MAX_PACKET;
+	slot->flags = BTSNOOP_FLAG_CMD_EVT | (received ? BTSNOOP_FLAG_RECEIVED : 0);
+	memcpy(slot->data, data, slot->len);
+
+	__atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+}
+
+void
+btsnoop_close(void)
+{
+	if (!btsnoop_enabled)
+		return;
+
+	btsnoop_enabled = 0;
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(writer, NULL);
+
+	fclose(out);
+	free(ring);
+	ring = NULL;
+}
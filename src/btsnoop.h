@@ -0,0 +1,21 @@
+
+#ifndef _HAVE_BTSNOOP_H
+#define _HAVE_BTSNOOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Packets are handed to a writer thread through a single-producer,
+   single-consumer ring; a full ring drops packets rather than block. */
+#define BTSNOOP_SLOTS				1024		/* a power of two. */
+#define BTSNOOP_MAX_PACKET	260			/* H4 type byte plus a full HCI packet. */
+
+extern int btsnoop_enabled;
+
+/* btsnoop.c */
+int btsnoop_open(const char *path);
+int btsnoop_start(void);
+void btsnoop_packet(const uint8_t *data, size_t len, int received);
+void btsnoop_close(void);
+
+#endif
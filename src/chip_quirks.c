@@ -0,0 +1,24 @@
+#include <stddef.h>
+
+#include "common.h"
+#include "chip_quirks.h"
+
+#define CHIP_ID_4330B2	0x43
+
+/* Indexed by chip id.  Options given on the command line always win
+   over what is listed here; add a chip only for a setting it really
+   needs. */
+static const struct chip_quirks quirks[256] = {
+	[CHIP_ID_4330B2] = {
+		.chip_id = CHIP_ID_4330B2,
+		.name = "BCM4330B2",
+		.no2bytes = 1,					/* no two bytes after Download_Minidriver. */
+		.flow_control = -1,
+	},
+};
+
+const struct chip_quirks *
+chip_quirks_lookup(uint8_t chip_id)
+{
+	return quirks[chip_id].name != NULL ? &quirks[chip_id] : NULL;
+}
@@ -0,0 +1,22 @@
+
+#ifndef _HAVE_CHIP_QUIRKS_H
+#define _HAVE_CHIP_QUIRKS_H
+
+#include <stdint.h>
+
+/* What a chip needs that would otherwise have to be passed by hand.
+   Zero (or -1 for flow_control) means the chip has no preference. */
+struct chip_quirks {
+	uint8_t			chip_id;	/* from Read Verbose Config Version Info. */
+	const char	*name;
+	int					no2bytes;
+	int					tosleep;				/* microseconds after Download_Minidriver. */
+	int					max_baudrate;
+	int					flow_control;		/* FLOW_CONTROL_*, or -1. */
+	int					baud_preserved;	/* keeps its rate across Launch_RAM. */
+};
+
+/* chip_quirks.c */
+const struct chip_quirks *chip_quirks_lookup(uint8_t chip_id);
+
+#endif
@@ -7,35 +7,602 @@
 #include <limits.h>
 #endif
 
-#define _B(n) { n, B ## n }
-int
-validate_baudrate(int requested_rate)
-{
-	struct rates {
-		int rate;
-		int termios_value;
-	} baud_rate[] = {
-		_B(115200), 
-		_B(230400),
-		_B(460800),
-		_B(500000),
-		_B(576000),
-		_B(921600),
-		_B(1000000),
-		_B(1152000),
-		_B(1500000),
-		_B(2000000),
-		_B(2500000),
-		_B(3000000),
-#ifndef __CYGWIN__
-		_B(3500000),
-		_B(4000000),
-#endif
-	};
-
-	for (unsigned i = 0; i < (sizeof (baud_rate)/sizeof (struct rates)); i++)
-		if (baud_rate[i].rate == requested_rate)
-			return baud_rate[i].termios_value;
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+
+#include "common.h"
+#include "btsnoop.h"
+#include "flightrec.h"
+#include "inventory.h"
+#include "probes.h"
+#include "session.h"
+
+/*
+ * glibc will not let us include <asm/termbits.h> next to <termios.h>,
+ * so carry our own copy of the kernel structure for BOTHER rates.
+ */
+#ifdef TCGETS2
+#ifndef IBSHIFT
+#define IBSHIFT	16
+#endif
+
+#ifndef ANDROID
+struct termios2 {
+	tcflag_t	c_iflag;
+	tcflag_t	c_oflag;
+	tcflag_t	c_cflag;
+	tcflag_t	c_lflag;
+	cc_t			c_line;
+	cc_t			c_cc[19];
+	speed_t		c_ispeed;
+	speed_t		c_ospeed;
+};
+#endif
+#endif
+
+#ifdef TCGETS2
+/* The line uart_set_baudrate() last put on a BOTHER rate, and that
+   rate.  termios can only hold a Bxxxx speed, so a plain tcsetattr()
+   with it would take such a line back to wherever termios points. */
+static int custom_fd = -1;
+static int custom_rate;
+
+/* Everything but the speed from termios, in one TCSETS2. */
+static int
+set_termios2(int fd, const struct termios *termios, int rate)
+{
+	struct termios2 t2;
+
+	if (ioctl(fd, TCGETS2, &t2) == -1)
+		return -1;
+
+	t2.c_iflag = termios->c_iflag;
+	t2.c_oflag = termios->c_oflag;
+	t2.c_lflag = termios->c_lflag;
+	t2.c_cflag = termios->c_cflag & ~(CBAUD | (CBAUD << IBSHIFT));
+	t2.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	memcpy(t2.c_cc, termios->c_cc, sizeof(t2.c_cc));
+	t2.c_ispeed = t2.c_ospeed = rate;
+
+	return ioctl(fd, TCSETS2, &t2);
+}
+#endif
+
+/* Every termios change after init goes through here, so a BOTHER
+   rate survives flow control and latency changes. */
+int
+uart_apply_termios(int fd, const struct termios *termios)
+{
+#ifdef TCGETS2
+	if (fd == custom_fd)
+		return set_termios2(fd, termios, custom_rate);
+#endif
+
+	return tcsetattr(fd, TCSANOW, termios);
+}
+
+/* Apply termios to the line at rate.  Returns the rate the driver
+   reports it is actually running at, or -1 if the rate could not be
+   set or is too far off the requested one to be usable. */
+int
+uart_set_baudrate(int fd, struct termios *termios, int rate)
+{
+	int termios_value = validate_baudrate(rate);
+
+	if (termios_value == -1)
+		return -1;
+
+#ifdef TCGETS2
+	if (fd == custom_fd)
+		custom_fd = -1;
+
+	if (termios_value == BOTHER) {
+		if (set_termios2(fd, termios, rate) == -1)
+			return -1;
+
+		custom_fd = fd;
+		custom_rate = rate;
+	} else
+#endif
+	{
+		cfsetospeed(termios, termios_value);
+		cfsetispeed(termios, termios_value);
+
+		if (tcsetattr(fd, TCSANOW, termios) == -1)
+			return -1;
+	}
+
+	int actual = rate;
+
+#ifdef TCGETS2
+	struct termios2 t2;
+
+	if (ioctl(fd, TCGETS2, &t2) == 0 && t2.c_ospeed != 0)
+		actual = t2.c_ospeed;
+#endif
+
+	if (abs(actual - rate) > (long long)rate * BRCM_BAUD_TOLERANCE / 1000) {
+		fprintf(stderr, "uart runs at %d instead of %d\n", actual, rate);
+		return -1;
+	}
+
+	PROBE1(baud_switch, actual);
+	session_baud(actual);
+	return actual;
+}
+
+/* Whether fd can be run at rate, within BRCM_BAUD_TOLERANCE.  The line
+   is tried at rate on a scratch copy of its settings and put back
+   exactly as it was, without going through uart_set_baudrate(): the
+   controller never sees this switch, so neither may --record or the
+   baud_switch probe. */
+int
+uart_rate_supported(int fd, int rate)
+{
+	int actual = rate;
+
+	if (validate_baudrate(rate) == -1)
+		return 0;
+
+#ifdef TCGETS2
+	struct termios2 saved, t2;
+
+	if (ioctl(fd, TCGETS2, &saved) == -1)
+		return 0;
+
+	t2 = saved;
+	t2.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	t2.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	t2.c_ispeed = t2.c_ospeed = rate;
+
+	if (ioctl(fd, TCSETS2, &t2) == -1 || ioctl(fd, TCGETS2, &t2) == -1)
+		actual = -1;
+	else if (t2.c_ospeed != 0)
+		actual = t2.c_ospeed;
+
+	ioctl(fd, TCSETS2, &saved);
+#else
+	struct termios saved, t;
+	int termios_value = validate_baudrate(rate);
+
+	if (tcgetattr(fd, &saved) == -1)
+		return 0;
+
+	t = saved;
+	cfsetospeed(&t, termios_value);
+	cfsetispeed(&t, termios_value);
+
+	if (tcsetattr(fd, TCSANOW, &t) == -1)
+		actual = -1;
+
+	tcsetattr(fd, TCSANOW, &saved);
+#endif
+
+	return actual != -1 && abs(actual - rate) <= (long long)rate * BRCM_BAUD_TOLERANCE / 1000;
+}
+
+/* Pack baud_rate into the four little-endian bytes the Broadcom
+   Update_UART_Baud_Rate command expects. */
+void
+BRCM_encode_baud_rate(unsigned baud_rate, uint8_t *encoded_baud)
+{
+	if (baud_rate == 0 || encoded_baud == NULL) {
+		fprintf(stderr, "Baudrate not supported!");
+		return;
+	}
+
+	encoded_baud[3] = (uint8_t)(baud_rate >> 24);
+	encoded_baud[2] = (uint8_t)(baud_rate >> 16);
+	encoded_baud[1] = (uint8_t)(baud_rate >> 8);
+	encoded_baud[0] = (uint8_t)(baud_rate & 0xFF);
+}
+
+/* Read up to len bytes, giving up once nothing has arrived for
+   timeout milliseconds.  Returns the number of bytes read. */
+static size_t
+read_timeout(int fd, uint8_t *buffer, size_t len, int timeout)
+{
+	size_t i = 0;
+
+	while (i < len) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		int ready = poll(&pfd, 1, timeout);
+
+		if (ready == -1 && errno == EINTR)
+			continue;
+
+		if (ready <= 0)
+			break;
+
+		ssize_t count = read(fd, &buffer[i], len - i);
+
+		if (count <= 0)
+			break;
+
+		i += count;
+	}
+
+	return i;
+}
+
+/* Hand one H4 packet that crossed the UART to everything capturing
+   it: --btsnoop, the flight recorder and --record. */
+void
+capture_packet(const uint8_t *data, size_t len, int received)
+{
+	btsnoop_packet(data, len, received);
+	flightrec_packet(data, len, received);
+	session_io(data, len, received);
+}
+
+/* When the header of the last event uart_read_event() returned came in. */
+uint64_t uart_event_us;
+
+/* Read one H4 event (packet type, event code, length, parameters).
+   Returns its total length, or 0 if it did not arrive in full within
+   timeout milliseconds of the previous byte. */
+int
+uart_read_event(int fd, uint8_t *buffer, size_t size, int timeout)
+{
+	if (size < 3 || read_timeout(fd, buffer, 3, timeout) < 3)
+		return 0;
+
+	uart_event_us = monotonic_us();
+
+	size_t len = buffer[2];
+
+	if (3 + len > size || read_timeout(fd, &buffer[3], len, timeout) < len)
+		return 0;
+
+	capture_packet(buffer, 3 + len, 1);
+	probe_event(buffer, 3 + len);
+	return 3 + len;
+}
+
+/* Returns the status of the Command Complete for opcode held in the
+   H4 event, or -1 if it is some other event. */
+int
+hci_cmd_status(const uint8_t *event, int len, uint16_t opcode)
+{
+	if (len < 7 || event[0] != 0x04 || event[1] != 0x0e)
+		return -1;
+
+	if ((event[4] | (event[5] << 8)) != opcode)
+		return -1;
+
+	return event[6];
+}
+
+uint64_t
+monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+rtt_record(struct rtt_stats *stats, uint64_t us)
+{
+	if (stats->count == 0 || us < stats->min_us)
+		stats->min_us = us;
+
+	if (us > stats->max_us)
+		stats->max_us = us;
+
+	if (stats->count < RTT_SAMPLES)
+		stats->samples[stats->count] = us > UINT32_MAX ? UINT32_MAX : us;
+
+	stats->count++;
+	stats->total_us += us;
+}
+
+static int
+compare_us(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+void
+rtt_report(const struct rtt_stats *stats, const char *label)
+{
+	if (stats->count == 0)
+		return;
+
+	fprintf(stderr, "%s: %u commands, round trip avg %llu us, min %llu us, max %llu us\n",
+		label, stats->count,
+		(unsigned long long)(stats->total_us / stats->count),
+		(unsigned long long)stats->min_us,
+		(unsigned long long)stats->max_us);
+
+	/* The tail is what turns into timeouts at high rates. */
+	unsigned n = stats->count < RTT_SAMPLES ? stats->count : RTT_SAMPLES;
+	uint32_t *sorted = malloc(n * sizeof(*sorted));
+
+	if (sorted == NULL)
+		return;
+
+	memcpy(sorted, stats->samples, n * sizeof(*sorted));
+	qsort(sorted, n, sizeof(*sorted), compare_us);
+
+	fprintf(stderr, "%s: round trip p50 %u us, p90 %u us, p99 %u us\n", label,
+		sorted[n * 50 / 100], sorted[n * 90 / 100], sorted[n * 99 / 100]);
+
+	free(sorted);
+}
+
+/* sysfs knob for the 8250 RX FIFO trigger level of the tty behind fd. */
+static int
+rx_trig_path(int fd, char *path, size_t size)
+{
+	const char *name = ttyname(fd);
+
+	if (name == NULL || strncmp(name, "/dev/", 5) != 0)
+		return -1;
+
+	snprintf(path, size, "/sys/class/tty/%s/rx_trig_bytes", name + 5);
+	return 0;
+}
+
+/*
+ * Low-latency profile: have the driver push every received byte to the
+ * tty layer immediately (ASYNC_LOW_LATENCY), interrupt on the first
+ * byte in the RX FIFO where the driver lets us choose, and return from
+ * read() as soon as a whole H4 event header is in.  VTIME stays
+ * non-zero so poll() still wakes on the first byte.
+ *
+ * Everything we touch is saved in *saved for uart_restore_latency().
+ */
+int
+uart_low_latency(int fd, struct termios *termios, struct uart_latency *saved)
+{
+	memset(saved, 0, sizeof(*saved));
+	saved->fd = fd;
+	saved->vmin = termios->c_cc[VMIN];
+	saved->vtime = termios->c_cc[VTIME];
+
+#ifdef TIOCGSERIAL
+	struct serial_struct serial;
+
+	if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+		saved->serial_flags = serial.flags;
+		saved->have_serial = 1;
+
+		serial.flags |= ASYNC_LOW_LATENCY;
+		if (ioctl(fd, TIOCSSERIAL, &serial) == -1)
+			fprintf(stderr, "Can't set ASYNC_LOW_LATENCY: %s\n", strerror(errno));
+	}
+#endif
+
+	char path[128];
+	int trig;
+
+	if (rx_trig_path(fd, path, sizeof(path)) == 0 && (trig = open(path, O_RDWR)) != -1) {
+		ssize_t len = read(trig, saved->rx_trig, sizeof(saved->rx_trig) - 1);
+
+		if (len > 0 && pwrite(trig, "1", 1, 0) == 1)
+			saved->have_rx_trig = 1;
+
+		close(trig);
+	}
+
+	termios->c_cc[VMIN] = 3;
+	termios->c_cc[VTIME] = 1;
+
+	return uart_apply_termios(fd, termios);
+}
+
+void
+uart_restore_latency(struct uart_latency *saved, struct termios *termios)
+{
+	if (saved->fd < 0)
+		return;
+
+	termios->c_cc[VMIN] = saved->vmin;
+	termios->c_cc[VTIME] = saved->vtime;
+	uart_apply_termios(saved->fd, termios);
+
+#ifdef TIOCGSERIAL
+	struct serial_struct serial;
+
+	if (saved->have_serial && ioctl(saved->fd, TIOCGSERIAL, &serial) == 0) {
+		serial.flags = saved->serial_flags;
+		ioctl(saved->fd, TIOCSSERIAL, &serial);
+	}
+#endif
+
+	char path[128];
+	int trig;
+
+	if (saved->have_rx_trig && rx_trig_path(saved->fd, path, sizeof(path)) == 0 &&
+			(trig = open(path, O_WRONLY)) != -1) {
+		if (write(trig, saved->rx_trig, strlen(saved->rx_trig)) == -1)
+			fprintf(stderr, "Can't restore %s\n", path);
+		close(trig);
+	}
+
+	saved->fd = -1;
+}
+
+int
+parse_flow_control_mode(const char *arg)
+{
+	if (strcmp(arg, "off") == 0)
+		return FLOW_CONTROL_OFF;
+	if (strcmp(arg, "on") == 0)
+		return FLOW_CONTROL_ON;
+	if (strcmp(arg, "auto") == 0)
+		return FLOW_CONTROL_AUTO;
 
 	return -1;
 }
+
+int
+uart_set_flow_control(int fd, struct termios *termios, int on)
+{
+	if (on)
+		termios->c_cflag |= CRTSCTS;
+	else
+		termios->c_cflag &= ~CRTSCTS;
+
+	return uart_apply_termios(fd, termios);
+}
+
+#define FLOW_PROBE_BURST		8
+#define FLOW_PROBE_TIMEOUT	100	/* milliseconds */
+
+/*
+ * Work out whether RTS/CTS is really wired up.  A controller that is
+ * listening drives CTS, so a line that is not asserted means either no
+ * wire or nobody on the other end.  If it is asserted, turn CRTSCTS on
+ * and run a burst of Read_Local_Version_Information commands: with a
+ * broken CTS line our output queue never drains, and overruns show up
+ * in the driver's counters.  Leaves flow control on if it works and
+ * returns 1, otherwise turns it off and returns 0.
+ */
+int
+uart_probe_flow_control(int fd, struct termios *termios)
+{
+	static const uint8_t read_local_version[] = { 0x01, 0x01, 0x10, 0x00 };
+	uint8_t event[64];
+	struct uart_icount before, after;
+	int lines;
+
+	if (ioctl(fd, TIOCMGET, &lines) == -1 || !(lines & TIOCM_CTS))
+		goto off;
+
+	uart_set_flow_control(fd, termios, 1);
+	uart_get_icount(fd, &before);
+
+	for (unsigned i = 0; i < FLOW_PROBE_BURST; i++) {
+		if (write(fd, read_local_version, sizeof(read_local_version)) != sizeof(read_local_version))
+			goto off;
+
+		capture_packet(read_local_version, sizeof(read_local_version), 0);
+
+		int len = uart_read_event(fd, event, sizeof(event), FLOW_PROBE_TIMEOUT);
+
+		if (hci_cmd_status(event, len, 0x1001) != 0)
+			goto off;
+	}
+
+	uart_get_icount(fd, &after);
+
+	if (after.overrun != before.overrun || after.buf_overrun != before.buf_overrun)
+		goto off;
+
+	return 1;
+
+off:
+	uart_set_flow_control(fd, termios, 0);
+	tcflush(fd, TCIOFLUSH);
+	return 0;
+}
+
+/* Send one inventory command and hand its answer to inv, skipping
+   anything else the controller has to say meanwhile. */
+static int
+uart_inventory_cmd(int fd, uint16_t opcode, struct brcm_inventory *inv)
+{
+	uint8_t cmd[] = { 0x01, opcode & 0xff, opcode >> 8, 0x00 };
+	uint8_t event[260];
+
+	PROBE_CMD(cmd);
+
+	if (write(fd, cmd, sizeof(cmd)) != sizeof(cmd)) {
+		inventory_fail(inv, opcode, strerror(errno));
+		return -1;
+	}
+
+	capture_packet(cmd, sizeof(cmd), 0);
+
+	int len;
+
+	while ((len = uart_read_event(fd, event, sizeof(event), INVENTORY_TIMEOUT)) > 0) {
+		if (hci_cmd_status(event, len, opcode) != -1)
+			return inventory_complete(inv, opcode, &event[6], len - 6);
+	}
+
+	inventory_fail(inv, opcode, "timeout");
+	return -1;
+}
+
+/* What --probe asks an H4 controller at the rate fd is set to: nothing
+   that changes its state beyond the reset.  Returns 0 if all of it
+   answered. */
+int
+uart_inventory(int fd, struct brcm_inventory *inv)
+{
+	if (uart_inventory_cmd(fd, INVENTORY_OP_RESET, inv) != 0)
+		return -1;
+
+	/* Carry on past a failure: whatever else answers is still news. */
+	int ret = uart_inventory_cmd(fd, INVENTORY_OP_VERBOSE_CONFIG, inv);
+	ret |= uart_inventory_cmd(fd, INVENTORY_OP_LOCAL_VERSION, inv);
+	ret |= uart_inventory_cmd(fd, INVENTORY_OP_BDADDR, inv);
+
+	return ret;
+}
+
+/* Without flow control nothing stops us overrunning the controller's
+   receive FIFO, so stay at or below BRCM_NOFLOW_MAX_BAUDRATE. */
+int
+flow_control_cap(int rate)
+{
+	int cap = brcm_baud_rates[0].rate;
+
+	if (rate <= BRCM_NOFLOW_MAX_BAUDRATE)
+		return rate;
+
+	for (unsigned i = 0; i < brcm_baud_rates_count; i++)
+		if (brcm_baud_rates[i].rate <= BRCM_NOFLOW_MAX_BAUDRATE)
+			cap = brcm_baud_rates[i].rate;
+
+	return cap;
+}
+
+int
+uart_get_icount(int fd, struct uart_icount *count)
+{
+	memset(count, 0, sizeof(*count));
+
+#ifdef TIOCGICOUNT
+	struct serial_icounter_struct icount;
+
+	if (ioctl(fd, TIOCGICOUNT, &icount) == 0) {
+		count->frame = icount.frame;
+		count->parity = icount.parity;
+		count->overrun = icount.overrun;
+		count->buf_overrun = icount.buf_overrun;
+		return 0;
+	}
+#endif
+
+	return -1;
+}
+
+void
+uart_report_icount(int fd, const struct uart_icount *since)
+{
+	struct uart_icount now;
+
+	if (uart_get_icount(fd, &now) == -1)
+		return;
+
+	fprintf(stderr, "uart: %d overruns, %d buffer overruns, %d framing errors, %d parity errors\n",
+		now.overrun - since->overrun, now.buf_overrun - since->buf_overrun,
+		now.frame - since->frame, now.parity - since->parity);
+}
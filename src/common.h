@@ -2,7 +2,76 @@
 #ifndef _HAVE_COMMON_H
 #define _HAVE_COMMON_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <termios.h>
+
+#include "baud.h"
+
+/* How far the rate the driver settles on may be from the one asked
+   for, in parts per thousand.  UARTs tolerate roughly 2-3%. */
+#define BRCM_BAUD_TOLERANCE	20
+
+/* Fastest rate we trust without RTS/CTS. */
+#define BRCM_NOFLOW_MAX_BAUDRATE	921600
+
+#define FLOW_CONTROL_OFF	0
+#define FLOW_CONTROL_ON		1
+#define FLOW_CONTROL_AUTO	2
+
+/* Round trips kept for the percentiles, enough for a whole download. */
+#define RTT_SAMPLES	4096
+
+struct rtt_stats {
+	unsigned	count;
+	uint64_t	total_us;
+	uint64_t	min_us;
+	uint64_t	max_us;
+	uint32_t	samples[RTT_SAMPLES];	/* the first RTT_SAMPLES of count. */
+};
+
+/* What uart_low_latency() changed, so it can be put back. */
+struct uart_latency {
+	int		fd;
+	cc_t	vmin;
+	cc_t	vtime;
+	int		have_serial;
+	int		serial_flags;
+	int		have_rx_trig;
+	char	rx_trig[16];
+};
+
+/* Line error counters from TIOCGICOUNT. */
+struct uart_icount {
+	int	frame;
+	int	parity;
+	int	overrun;
+	int	buf_overrun;
+};
+
+struct brcm_inventory;
+
 /* comm.c */
-int validate_baudrate(int requested_rate);
+extern uint64_t uart_event_us;
+
+int uart_set_baudrate(int fd, struct termios *termios, int rate);
+int uart_apply_termios(int fd, const struct termios *termios);
+int uart_rate_supported(int fd, int rate);
+void BRCM_encode_baud_rate(unsigned baud_rate, uint8_t *encoded_baud);
+void capture_packet(const uint8_t *data, size_t len, int received);
+int uart_read_event(int fd, uint8_t *buffer, size_t size, int timeout);
+int hci_cmd_status(const uint8_t *event, int len, uint16_t opcode);
+uint64_t monotonic_us(void);
+void rtt_record(struct rtt_stats *stats, uint64_t us);
+void rtt_report(const struct rtt_stats *stats, const char *label);
+int uart_low_latency(int fd, struct termios *termios, struct uart_latency *saved);
+void uart_restore_latency(struct uart_latency *saved, struct termios *termios);
+int parse_flow_control_mode(const char *arg);
+int uart_set_flow_control(int fd, struct termios *termios, int on);
+int uart_probe_flow_control(int fd, struct termios *termios);
+int flow_control_cap(int rate);
+int uart_get_icount(int fd, struct uart_icount *count);
+void uart_report_icount(int fd, const struct uart_icount *since);
+int uart_inventory(int fd, struct brcm_inventory *inv);
 
 #endif
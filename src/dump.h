@@ -0,0 +1,23 @@
+
+#ifndef _HAVE_DUMP_H
+#define _HAVE_DUMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compile-time ceiling on logging: with LOG_LEVEL=1 (errors only) on
+   the make command line, every log_debug() branch is dead code and is
+   dropped, whatever -d says at run time. */
+#define BRCM_LOG_ERROR	1
+#define BRCM_LOG_DEBUG	2
+
+#ifndef BRCM_LOG_LEVEL
+#define BRCM_LOG_LEVEL	BRCM_LOG_DEBUG
+#endif
+
+#define log_debug()	(BRCM_LOG_LEVEL >= BRCM_LOG_DEBUG && debug)
+
+/* dump.c */
+void dump(const uint8_t *out, size_t len);
+
+#endif
@@ -0,0 +1,23 @@
+
+#ifndef _HAVE_EMBEDDED_HCD_H
+#define _HAVE_EMBEDDED_HCD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* An HCD image linked into the binary with EMBED_HCD=chip_id:file. */
+struct embedded_hcd {
+	uint8_t				chip_id;	/* from Read Verbose Config Version Info. */
+	const char		*name;
+	const uint8_t	*data;
+	size_t				size;
+	unsigned			records;	/* all checked when the image was built in. */
+};
+
+/* embedded_hcd.c, generated by gen_embed, or embedded_hcd_empty.c */
+extern const struct embedded_hcd embedded_hcds[];
+extern const unsigned embedded_hcd_count;
+
+const struct embedded_hcd *embedded_hcd_lookup(uint8_t chip_id);
+
+#endif
@@ -0,0 +1,16 @@
+/* embedded_hcd.c for a build without EMBED_HCD, so no host tool has
+   to run: nothing is built in. */
+
+#include "embedded_hcd.h"
+
+const struct embedded_hcd embedded_hcds[] = {
+	{ 0, NULL, NULL, 0, 0 }
+};
+
+const unsigned embedded_hcd_count = 0;
+
+const struct embedded_hcd *
+embedded_hcd_lookup(uint8_t chip_id __attribute__ ((unused)))
+{
+	return NULL;
+}
@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flightrec.h"
+
+static struct flightrec_entry ring[FLIGHTREC_ENTRIES];
+static unsigned next;
+static const char *tool_name = "";
+static const char *dump_path;
+static volatile sig_atomic_t dumped;
+static const char *volatile failure;
+static int done;
+
+static const int fatal_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT, SIGTERM, SIGINT };
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct flightrec_entry *
+claim(int kind)
+{
+	struct flightrec_entry *e = &ring[next++ % FLIGHTREC_ENTRIES];
+
+	e->ts_us = now_us();
+	e->kind = kind;
+	return e;
+}
+
+/* An H4 packet.  A received Command Complete or Command Status with a
+   non-zero status counts as a failure. */
+void
+flightrec_packet(const uint8_t *data, size_t len, int received)
+{
+	struct flightrec_entry *e = claim(received ? FLIGHTREC_RECEIVED : FLIGHTREC_SENT);
+
+	e->len = len;
+	e->kept = len < FLIGHTREC_BYTES ? len : FLIGHTREC_BYTES;
+	memcpy(e->data, data, e->kept);
+
+	if (received && len >= 7 && data[0] == 0x04 &&
+			((data[1] == 0x0e && data[6] != 0) || (data[1] == 0x0f && data[3] != 0)))
+		flightrec_failed("error status");
+}
+
+/* Something went wrong that the caller may yet recover from: autobaud
+   and --probe expect some commands to fail, and a record that times
+   out is sent again.  Only the first reason is kept, and the ring is
+   dumped with it if we then exit without reaching flightrec_done().
+   Safe from a signal handler. */
+void
+flightrec_failed(const char *reason)
+{
+	if (failure == NULL)
+		failure = reason;
+}
+
+/* A command handed to the kernel as opcode and parameters. */
+void
+flightrec_command(uint16_t opcode, const void *param, uint8_t plen)
+{
+	struct flightrec_entry *e = claim(FLIGHTREC_SENT);
+
+	e->data[0] = 0x01;
+	e->data[1] = opcode & 0xff;
+	e->data[2] = opcode >> 8;
+	e->data[3] = plen;
+	e->len = 4 + plen;
+	e->kept = e->len < FLIGHTREC_BYTES ? e->len : FLIGHTREC_BYTES;
+
+	if (e->kept > 4)
+		memcpy(&e->data[4], param, e->kept - 4);
+}
+
+/* state must be a string that outlives the program, e.g. a literal. */
+void
+flightrec_state(const char *state)
+{
+	claim(FLIGHTREC_STATE)->state = state;
+}
+
+/* What follows has to be async-signal-safe: no stdio, no malloc. */
+
+static char *
+put_str(char *p, const char *s)
+{
+	while (*s)
+		*p++ = *s++;
+	return p;
+}
+
+/* Right-aligned in width, with a minus sign. */
+static char *
+put_neg(char *p, uint64_t v, int width)
+{
+	char digits[24];
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+
+	digits[n++] = '-';
+
+	while (width-- > n)
+		*p++ = ' ';
+
+	while (n)
+		*p++ = digits[--n];
+
+	return p;
+}
+
+static char *
+put_hex(char *p, uint8_t v)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	*p++ = hex[v >> 4];
+	*p++ = hex[v & 15];
+	return p;
+}
+
+/*
+ * Write the ring, oldest first, with times relative to now:
+ *
+ *   flight recorder: timeout (brcm_patchram_plus)
+ *      -1523 us > 01 4c fc 14 ...
+ *        -12 us < 04 0e 04 01 4c fc 00
+ *
+ * to the --flightrec file if one was given, otherwise to stderr.
+ * Failures only dump once; a fatal signal always does.
+ */
+void
+flightrec_dump(const char *reason)
+{
+	char line[64 + 3 * FLIGHTREC_BYTES], *p;
+	uint64_t now = now_us();
+	int fd = 2;
+
+	if (dumped)
+		return;
+
+	dumped = 1;
+
+	if (dump_path && (fd = open(dump_path, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1)
+		fd = 2;
+
+	p = put_str(line, "flight recorder: ");
+	p = put_str(p, reason);
+	p = put_str(p, " (");
+	p = put_str(p, tool_name);
+	p = put_str(p, ")\n");
+	write(fd, line, p - line);
+
+	for (unsigned i = 0; i < FLIGHTREC_ENTRIES; i++) {
+		const struct flightrec_entry *e = &ring[(next + i) % FLIGHTREC_ENTRIES];
+
+		if (e->ts_us == 0)
+			continue;
+
+		p = put_str(line, "  ");
+		p = put_neg(p, now - e->ts_us, 10);
+		p = put_str(p, " us ");
+
+		if (e->kind == FLIGHTREC_STATE) {
+			p = put_str(p, "state ");
+			p = put_str(p, e->state);
+		} else {
+			*p++ = e->kind == FLIGHTREC_RECEIVED ? '<' : '>';
+
+			for (unsigned j = 0; j < e->kept; j++) {
+				*p++ = ' ';
+				p = put_hex(p, e->data[j]);
+			}
+
+			if (e->kept < e->len)
+				p = put_str(p, " ...");
+		}
+
+		*p++ = '\n';
+		write(fd, line, p - line);
+	}
+
+	if (fd != 2)
+		close(fd);
+}
+
+static void
+fatal(int sig)
+{
+	dumped = 0;
+	flightrec_dump(sig == SIGTERM || sig == SIGINT ? "terminated" : "fatal signal");
+
+	/* SA_RESETHAND put the default action back. */
+	raise(sig);
+}
+
+/* Before parking with the line discipline attached, or exiting after
+   a good run: being stopped from then on is the normal way out, not a
+   failure, and neither is a command that failed along the way. */
+void
+flightrec_done(void)
+{
+	done = 1;
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+}
+
+static void
+dump_at_exit(void)
+{
+	if (failure && !done)
+		flightrec_dump(failure);
+}
+
+void
+flightrec_init(const char *tool, const char *path)
+{
+	struct sigaction sa;
+
+	tool_name = tool;
+	dump_path = path;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = fatal;
+	sa.sa_flags = SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+
+	for (unsigned i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); i++)
+		sigaction(fatal_signals[i], &sa, NULL);
+
+	atexit(dump_at_exit);
+}
@@ -0,0 +1,35 @@
+
+#ifndef _HAVE_FLIGHTREC_H
+#define _HAVE_FLIGHTREC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The last FLIGHTREC_ENTRIES packets and state changes, kept in every
+   run and written out when something goes wrong. */
+#define FLIGHTREC_ENTRIES	64
+#define FLIGHTREC_BYTES		24		/* of each packet kept. */
+
+#define FLIGHTREC_SENT			0
+#define FLIGHTREC_RECEIVED	1
+#define FLIGHTREC_STATE			2
+
+struct flightrec_entry {
+	uint64_t		ts_us;
+	uint8_t			kind;
+	uint8_t			kept;
+	uint16_t		len;
+	uint8_t			data[FLIGHTREC_BYTES];
+	const char	*state;
+};
+
+/* flightrec.c */
+void flightrec_init(const char *tool, const char *path);
+void flightrec_packet(const uint8_t *data, size_t len, int received);
+void flightrec_command(uint16_t opcode, const void *param, uint8_t plen);
+void flightrec_state(const char *state);
+void flightrec_failed(const char *reason);
+void flightrec_dump(const char *reason);
+void flightrec_done(void);
+
+#endif
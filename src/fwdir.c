@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "fwdir.h"
+
+/*
+ * The index file keeps one line per .hcd file:
+ *
+ *   mtime size chip build name
+ *
+ * under a header with the directory and its mtime.  While the directory
+ * mtime is unchanged the index is used as is; otherwise the directory
+ * is listed again.  Nothing is read but the names and their stat().
+ */
+#define FW_INDEX_MAGIC	"brcm-hcd-index 2"
+
+static int64_t
+mtime_ns(const struct stat *st)
+{
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static int
+has_suffix(const char *name, const char *suffix)
+{
+	size_t n = strlen(name), s = strlen(suffix);
+
+	return n > s && strcasecmp(name + n - s, suffix) == 0;
+}
+
+/* BCM4330B1_002.001.003.0221.0265.hcd -> BCM4330B1, 002.001.003.0221.0265 */
+static void
+split_name(struct fw_entry *e)
+{
+	size_t base = strlen(e->name) - strlen(".hcd");
+	size_t chip = strcspn(e->name, "_.");
+
+	snprintf(e->chip, sizeof(e->chip), "%.*s", (int)chip, e->name);
+
+	if (chip < base)
+		snprintf(e->build, sizeof(e->build), "%.*s", (int)(base - chip - 1), e->name + chip + 1);
+	else
+		strcpy(e->build, "-");
+
+	/* Both are single words in the index file. */
+	for (char *p = e->chip; *p; p++)
+		if (*p == ' ' || *p == '\t')
+			*p = '-';
+
+	for (char *p = e->build; *p; p++)
+		if (*p == ' ' || *p == '\t')
+			*p = '-';
+}
+
+static void
+read_index(struct fw_index *idx, const char *index_path)
+{
+	char line[512], dir[4096];
+	FILE *in;
+
+	if ((in = fopen(index_path, "r")) == NULL)
+		return;
+
+	if (!fgets(line, sizeof(line), in) ||
+			sscanf(line, FW_INDEX_MAGIC " %lld %4095[^\n]", (long long *)&idx->dir_mtime, dir) != 2 ||
+			strcmp(dir, idx->dir) != 0) {
+		idx->dir_mtime = 0;
+		fclose(in);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), in)) {
+		struct fw_entry e;
+		long long mtime, size;
+		int n;
+
+		if (sscanf(line, "%lld %lld %31s %63s %n", &mtime, &size, e.chip, e.build, &n) != 4)
+			continue;
+
+		line[strcspn(line, "\n")] = '\0';
+		snprintf(e.name, sizeof(e.name), "%s", line + n);
+		e.mtime = mtime;
+		e.size = size;
+
+		struct fw_entry *entries = realloc(idx->entries, (idx->count + 1) * sizeof(e));
+
+		if (entries == NULL)
+			break;
+
+		idx->entries = entries;
+		idx->entries[idx->count++] = e;
+	}
+
+	fclose(in);
+}
+
+static int
+rescan(struct fw_index *idx, int dirfd)
+{
+	struct dirent *d;
+	DIR *dir;
+
+	if ((dir = fdopendir(dup(dirfd))) == NULL)
+		return -1;
+
+	free(idx->entries);
+	idx->entries = NULL;
+	idx->count = 0;
+
+	while ((d = readdir(dir)) != NULL) {
+		struct fw_entry e;
+		struct stat st;
+
+		if (!has_suffix(d->d_name, ".hcd") || strlen(d->d_name) >= sizeof(e.name) ||
+				fstatat(dirfd, d->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode))
+			continue;
+
+		strcpy(e.name, d->d_name);
+		split_name(&e);
+		e.mtime = mtime_ns(&st);
+		e.size = st.st_size;
+
+		struct fw_entry *entries = realloc(idx->entries, (idx->count + 1) * sizeof(e));
+
+		if (entries == NULL)
+			break;
+
+		idx->entries = entries;
+		idx->entries[idx->count++] = e;
+	}
+
+	closedir(dir);
+	idx->rescans++;
+	idx->dirty = 1;
+	return 0;
+}
+
+/* Load the index for dir, bringing it up to date with the directory. */
+int
+fw_index_load(struct fw_index *idx, const char *dir, const char *index_path)
+{
+	struct stat st;
+	int dirfd, ret = 0;
+
+	memset(idx, 0, sizeof(*idx));
+	idx->dir = dir;
+
+	if ((dirfd = open(dir, O_RDONLY | O_DIRECTORY)) == -1)
+		return -1;
+
+	if (fstat(dirfd, &st) == -1) {
+		close(dirfd);
+		return -1;
+	}
+
+	read_index(idx, index_path);
+
+	if (idx->dir_mtime != mtime_ns(&st)) {
+		idx->dir_mtime = mtime_ns(&st);
+		ret = rescan(idx, dirfd);
+	}
+
+	close(dirfd);
+	return ret;
+}
+
+/* The newest build for chip, the controller's local name.  An exact
+   chip match beats one where the name is only a prefix of the file's
+   (BCM20702A from ROM against BCM20702A1_*.hcd). */
+static struct fw_entry *
+select_entry(struct fw_index *idx, const char *chip)
+{
+	struct fw_entry *best = NULL;
+	int best_exact = 0;
+
+	for (unsigned i = 0; i < idx->count; i++) {
+		struct fw_entry *e = &idx->entries[i];
+		int exact = strcasecmp(e->chip, chip) == 0;
+
+		if (!exact && strncasecmp(e->chip, chip, strlen(chip)) != 0)
+			continue;
+
+		if (best == NULL || exact > best_exact ||
+				(exact == best_exact && strverscmp(e->build, best->build) > 0)) {
+			best = e;
+			best_exact = exact;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * select_entry(), with the choice checked against the directory first.
+ * A firmware image replaced or removed in place leaves the directory
+ * mtime alone, so if the file is gone or its stat() no longer matches,
+ * the index is stale: list the directory again and choose again.
+ */
+const struct fw_entry *
+fw_index_select(struct fw_index *idx, const char *chip)
+{
+	struct fw_entry *best = select_entry(idx, chip);
+	struct stat st;
+	int dirfd;
+
+	if (best == NULL || (dirfd = open(idx->dir, O_RDONLY | O_DIRECTORY)) == -1)
+		return best;
+
+	if (fstatat(dirfd, best->name, &st, 0) == -1 ||
+			mtime_ns(&st) != best->mtime || st.st_size != best->size) {
+		best = rescan(idx, dirfd) == 0 ? select_entry(idx, chip) : NULL;
+	}
+
+	close(dirfd);
+	return best;
+}
+
+/* Write the index back if anything changed, atomically. */
+int
+fw_index_save(struct fw_index *idx, const char *index_path)
+{
+	char tmp[4096];
+	FILE *out;
+
+	if (!idx->dirty)
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", index_path);
+
+	if ((out = fopen(tmp, "w")) == NULL)
+		return -1;
+
+	fprintf(out, FW_INDEX_MAGIC " %lld %s\n", (long long)idx->dir_mtime, idx->dir);
+
+	for (unsigned i = 0; i < idx->count; i++) {
+		const struct fw_entry *e = &idx->entries[i];
+
+		fprintf(out, "%lld %lld %s %s %s\n", (long long)e->mtime,
+			(long long)e->size, e->chip, e->build, e->name);
+	}
+
+	if (fclose(out) != 0 || rename(tmp, index_path) == -1) {
+		unlink(tmp);
+		return -1;
+	}
+
+	idx->dirty = 0;
+	return 0;
+}
+
+void
+fw_index_free(struct fw_index *idx)
+{
+	free(idx->entries);
+	idx->entries = NULL;
+	idx->count = 0;
+}
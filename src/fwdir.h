@@ -0,0 +1,32 @@
+
+#ifndef _HAVE_FWDIR_H
+#define _HAVE_FWDIR_H
+
+#include <stdint.h>
+
+/* One .hcd file of a firmware directory.  chip and build come from the
+   usual BCM4330B1_002.001.003.0221.0265.hcd naming. */
+struct fw_entry {
+	char			name[256];
+	char			chip[32];
+	char			build[64];
+	int64_t		mtime;		/* nanoseconds. */
+	int64_t		size;
+};
+
+struct fw_index {
+	const char			*dir;
+	int64_t					dir_mtime;
+	struct fw_entry	*entries;
+	unsigned				count;
+	unsigned				rescans;	/* directory listings during this run. */
+	int							dirty;
+};
+
+/* fwdir.c */
+int fw_index_load(struct fw_index *idx, const char *dir, const char *index_path);
+const struct fw_entry *fw_index_select(struct fw_index *idx, const char *chip);
+int fw_index_save(struct fw_index *idx, const char *index_path);
+void fw_index_free(struct fw_index *idx);
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ *  gen_embed.c
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ *  Name: gen_embed.c
+ *
+ *  Description:
+ *
+ *   Build-time generator for embedded_hcd.c.  Each argument names a
+ *   chip id and an HCD file:
+ *
+ *     gen_embed 0x43:BCM4330B2.hcd 0x29:BCM4329B1.hcd > embedded_hcd.c
+ *
+ *   Every record of every file is checked here, so a truncated image
+ *   fails the build instead of a boot.  With no arguments the table is
+ *   empty.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+static uint8_t *
+read_file(const char *path, size_t *size)
+{
+	uint8_t *data = NULL;
+	size_t n = 0, cap = 0;
+	FILE *in;
+
+	if ((in = fopen(path, "rb")) == NULL)
+		return NULL;
+
+	for (;;) {
+		if (n == cap && (data = realloc(data, cap = cap ? cap * 2 : 65536)) == NULL)
+			break;
+
+		size_t got = fread(data + n, 1, cap - n, in);
+
+		if (got == 0)
+			break;
+
+		n += got;
+	}
+
+	fclose(in);
+	*size = n;
+	return data;
+}
+
+/* Number of records, or -1 if the last one is cut short. */
+static int
+count_records(const uint8_t *data, size_t size)
+{
+	size_t offset = 0;
+	int records = 0;
+
+	while (offset < size) {
+		if (size - offset < 3 || size - offset - 3 < data[offset + 2])
+			return -1;
+
+		offset += 3 + data[offset + 2];
+		records++;
+	}
+
+	return records;
+}
+
+int
+main(int argc, char **argv)
+{
+	int records[argc];
+	unsigned long chip_ids[argc];
+
+	printf("/* Generated by gen_embed -- do not edit. */\n\n");
+	printf("#include \"embedded_hcd.h\"\n");
+
+	for (int i = 1; i < argc; i++) {
+		char *path = strchr(argv[i], ':'), *end;
+		uint8_t *data;
+		size_t size;
+
+		if (path == NULL) {
+			fprintf(stderr, "gen_embed: %s: expected chip_id:file\n", argv[i]);
+			return 1;
+		}
+
+		/* Anything but a bare number before the ':' is a typo, not chip 0. */
+		chip_ids[i] = strtoul(argv[i], &end, 0);
+
+		if (end == argv[i] || end != path) {
+			fprintf(stderr, "gen_embed: %s: chip id is not a number\n", argv[i]);
+			return 1;
+		}
+
+		if (chip_ids[i] > 0xff) {
+			fprintf(stderr, "gen_embed: %s: chip id out of range\n", argv[i]);
+			return 1;
+		}
+
+		path++;
+
+		if ((data = read_file(path, &size)) == NULL) {
+			fprintf(stderr, "gen_embed: %s could not be read\n", path);
+			return 1;
+		}
+
+		if ((records[i] = count_records(data, size)) <= 0) {
+			fprintf(stderr, "gen_embed: %s is %s\n", path, records[i] ? "truncated" : "empty");
+			return 1;
+		}
+
+		printf("\n/* %s */\nstatic const uint8_t hcd_%d[%zu] = {", path, i, size);
+
+		for (size_t j = 0; j < size; j++)
+			printf("%s0x%02x,", j % 12 ? " " : "\n\t", data[j]);
+
+		printf("\n};\n");
+		free(data);
+	}
+
+	printf("\nconst struct embedded_hcd embedded_hcds[] = {\n");
+
+	for (int i = 1; i < argc; i++) {
+		const char *name = strrchr(strchr(argv[i], ':'), '/');
+
+		name = name ? name + 1 : strchr(argv[i], ':') + 1;
+
+		printf("\t{ 0x%02lx, \"%s\", hcd_%d, sizeof(hcd_%d), %d },\n", chip_ids[i],
+			name, i, i, records[i]);
+	}
+
+	printf("\t{ 0, NULL, NULL, 0, 0 }\n};\n\n");
+	printf("const unsigned embedded_hcd_count = %d;\n\n", argc - 1);
+	printf("const struct embedded_hcd *\n");
+	printf("embedded_hcd_lookup(uint8_t chip_id)\n");
+	printf("{\n");
+	printf("\tfor (unsigned i = 0; i < embedded_hcd_count; i++)\n");
+	printf("\t\tif (embedded_hcds[i].chip_id == chip_id)\n");
+	printf("\t\t\treturn &embedded_hcds[i];\n\n");
+	printf("\treturn NULL;\n");
+	printf("}\n");
+
+	return 0;
+}
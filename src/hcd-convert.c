@@ -0,0 +1,475 @@
+/*
+ *  hcd-convert.c
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ *  Name: hcd-convert.c
+ *
+ *  Description:
+ *
+ *   Convert Intel HEX, raw RAM images and HCD files to a compact HCD,
+ *   or any of them to Intel HEX for diffing.  Consecutive bytes are
+ *   packed into Write_RAM records of the full 251 bytes a command can
+ *   carry, so proc_patchram() sends as few commands as possible, and
+ *   the output ends with a single Launch_RAM.
+ *
+ *   Inputs are read front to back and written out as they go, holding
+ *   at most one record, so bundles of any size convert in constant
+ *   memory.  Several inputs are concatenated in the order given.
+ *
+ *   It can be invoked from the command line in the form:
+ *
+ *     --to hcd|hex       - output format (default hcd)
+ *     --launch <addr>    - Launch_RAM address, instead of the one in the
+ *                          input (default 0xffffffff)
+ *     --output <file>    - default stdout
+ *     input ...          - file.hcd, file.hex, or file.bin@addr for a
+ *                          raw image loaded at addr; - is stdin (HEX)
+ *
+ *  Example:
+ *
+ *    hcd-convert --output BCM4330B1.hcd BCM4330B1.hex
+ *    hcd-convert --to hex old.hcd > old.hex
+ *
+ *  HCD records other than Write_RAM and Launch_RAM are copied as they
+ *  are into HCD output; HEX has no place for them, so they are
+ *  dropped with a warning.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "hcd.h"
+
+#define MAX_WRITE_DATA	251		/* 255 parameter bytes less the address. */
+#define HEX_LINE_DATA		16
+
+enum format { FORMAT_HCD, FORMAT_HEX, FORMAT_RAW };
+
+struct settings {
+	enum format	to;
+	int					launch_given;
+	uint32_t		launch;
+} settings = { FORMAT_HCD, 0, 0xffffffff };
+
+/* The output, with the one Write_RAM still being filled. */
+struct sink {
+	FILE			*out;
+	uint32_t	addr;
+	unsigned	len;
+	uint8_t		data[MAX_WRITE_DATA];
+	uint32_t	hex_upper;				/* upper 16 address bits last written. */
+	int				hex_upper_valid;
+	unsigned	dropped;
+	int				launch_seen;
+	uint32_t	launch;
+};
+
+static void
+put_hcd(struct sink *s, uint16_t opcode, const uint8_t *params, uint8_t plen)
+{
+	uint8_t hdr[3] = { opcode & 0xff, opcode >> 8, plen };
+
+	fwrite(hdr, 1, 3, s->out);
+	fwrite(params, 1, plen, s->out);
+}
+
+static void
+put_hex_line(struct sink *s, uint8_t type, uint16_t addr, const uint8_t *data, unsigned len)
+{
+	uint8_t sum = len + (addr >> 8) + (addr & 0xff) + type;
+
+	fprintf(s->out, ":%02X%04X%02X", len, addr, type);
+
+	for (unsigned i = 0; i < len; i++) {
+		fprintf(s->out, "%02X", data[i]);
+		sum += data[i];
+	}
+
+	fprintf(s->out, "%02X\n", (uint8_t)-sum);
+}
+
+static void
+put_hex_data(struct sink *s, uint32_t addr, const uint8_t *data, unsigned len)
+{
+	while (len) {
+		unsigned n = len < HEX_LINE_DATA ? len : HEX_LINE_DATA;
+
+		/* A line may not cross into the next 64K. */
+		if ((addr & 0xffff) + n > 0x10000)
+			n = 0x10000 - (addr & 0xffff);
+
+		if (!s->hex_upper_valid || s->hex_upper != addr >> 16) {
+			uint8_t upper[2] = { addr >> 24, addr >> 16 };
+
+			put_hex_line(s, 0x04, 0, upper, 2);
+			s->hex_upper = addr >> 16;
+			s->hex_upper_valid = 1;
+		}
+
+		put_hex_line(s, 0x00, addr & 0xffff, data, n);
+		addr += n;
+		data += n;
+		len -= n;
+	}
+}
+
+static void
+flush(struct sink *s)
+{
+	if (s->len == 0)
+		return;
+
+	if (settings.to == FORMAT_HCD) {
+		uint8_t params[4 + MAX_WRITE_DATA] = { s->addr, s->addr >> 8, s->addr >> 16, s->addr >> 24 };
+
+		memcpy(&params[4], s->data, s->len);
+		put_hcd(s, HCD_WRITE_RAM, params, 4 + s->len);
+	} else {
+		put_hex_data(s, s->addr, s->data, s->len);
+	}
+
+	s->len = 0;
+}
+
+/* Bytes for RAM at addr.  They join the pending record if they carry
+   straight on from it. */
+static void
+sink_data(struct sink *s, uint32_t addr, const uint8_t *data, size_t len)
+{
+	while (len) {
+		if (s->len && (s->len == MAX_WRITE_DATA || addr != s->addr + s->len))
+			flush(s);
+
+		if (s->len == 0)
+			s->addr = addr;
+
+		unsigned n = MAX_WRITE_DATA - s->len;
+
+		if (n > len)
+			n = len;
+
+		memcpy(&s->data[s->len], data, n);
+		s->len += n;
+		addr += n;
+		data += n;
+		len -= n;
+	}
+}
+
+/* Any other HCD record is kept where it was relative to the writes. */
+static void
+sink_command(struct sink *s, uint16_t opcode, const uint8_t *params, uint8_t plen)
+{
+	flush(s);
+
+	if (settings.to == FORMAT_HCD) {
+		put_hcd(s, opcode, params, plen);
+	} else {
+		s->dropped++;
+	}
+}
+
+static void
+sink_launch(struct sink *s, uint32_t addr)
+{
+	s->launch_seen = 1;
+	s->launch = addr;
+}
+
+static void
+sink_end(struct sink *s)
+{
+	uint32_t addr = settings.launch_given || !s->launch_seen ? settings.launch : s->launch;
+
+	flush(s);
+
+	if (settings.to == FORMAT_HCD) {
+		uint8_t params[4] = { addr, addr >> 8, addr >> 16, addr >> 24 };
+
+		put_hcd(s, HCD_LAUNCH_RAM, params, 4);
+	} else {
+		uint8_t start[4] = { addr >> 24, addr >> 16, addr >> 8, addr };
+
+		put_hex_line(s, 0x05, 0, start, 4);
+		put_hex_line(s, 0x01, 0, NULL, 0);
+	}
+}
+
+static int
+hex_byte(const char *p)
+{
+	if (!isxdigit((unsigned char)p[0]) || !isxdigit((unsigned char)p[1]))
+		return -1;
+
+	char b[3] = { p[0], p[1], '\0' };
+
+	return strtoul(b, NULL, 16);
+}
+
+/* Intel HEX: data, end of file, extended segment and linear addresses
+   and the two start addresses.  More images may follow an end of file
+   record. */
+static int
+read_hex(FILE *in, const char *name, struct sink *s)
+{
+	char line[600];
+	uint8_t rec[256 + 5];
+	uint32_t base = 0;
+	unsigned lineno = 0;
+
+	while (fgets(line, sizeof(line), in)) {
+		size_t n = strcspn(line, "\r\n");
+		int i, b;
+
+		lineno++;
+		line[n] = '\0';
+
+		if (n == 0)
+			continue;
+
+		if (line[0] != ':' || n < 11 || (n - 1) % 2) {
+			fprintf(stderr, "%s:%u: not an Intel HEX record\n", name, lineno);
+			return -1;
+		}
+
+		uint8_t sum = 0;
+
+		for (i = 0; i < (int)(n - 1) / 2; i++) {
+			if ((b = hex_byte(&line[1 + 2 * i])) == -1) {
+				fprintf(stderr, "%s:%u: bad hex digit\n", name, lineno);
+				return -1;
+			}
+
+			rec[i] = b;
+			sum += b;
+		}
+
+		if (sum != 0 || rec[0] + 5 != i) {
+			fprintf(stderr, "%s:%u: bad %s\n", name, lineno, sum ? "checksum" : "length");
+			return -1;
+		}
+
+		uint8_t len = rec[0], type = rec[3];
+		uint16_t offset = rec[1] << 8 | rec[2];
+		const uint8_t *data = &rec[4];
+
+		if (((type == 0x02 || type == 0x04) && len != 2) || ((type == 0x03 || type == 0x05) && len != 4)) {
+			fprintf(stderr, "%s:%u: bad length for record type %02x\n", name, lineno, type);
+			return -1;
+		}
+
+		switch (type) {
+			case 0x00:
+				sink_data(s, base + offset, data, len);
+				break;
+			case 0x01:
+				base = 0;
+				break;
+			case 0x02:
+				base = (data[0] << 8 | data[1]) << 4;
+				break;
+			case 0x03:
+				sink_launch(s, ((data[0] << 8 | data[1]) << 4) + (data[2] << 8 | data[3]));
+				break;
+			case 0x04:
+				base = (uint32_t)(data[0] << 8 | data[1]) << 16;
+				break;
+			case 0x05:
+				sink_launch(s, (uint32_t)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3]);
+				break;
+			default:
+				fprintf(stderr, "%s:%u: unknown record type %02x\n", name, lineno, type);
+				return -1;
+		}
+	}
+
+	return ferror(in) ? -1 : 0;
+}
+
+static int
+read_hcd(FILE *in, const char *name, struct sink *s)
+{
+	uint8_t hdr[3], params[255];
+	long offset = 0;
+	size_t got;
+
+	while ((got = fread(hdr, 1, 3, in)) == 3) {
+		uint16_t opcode = hdr[0] | hdr[1] << 8;
+		uint8_t plen = hdr[2];
+
+		if (fread(params, 1, plen, in) != plen)
+			break;
+
+		if (opcode == HCD_WRITE_RAM && plen > 4) {
+			sink_data(s, params[0] | params[1] << 8 | params[2] << 16 | (uint32_t)params[3] << 24,
+				&params[4], plen - 4);
+		} else if (opcode == HCD_LAUNCH_RAM && plen >= 4) {
+			sink_launch(s, params[0] | params[1] << 8 | params[2] << 16 | (uint32_t)params[3] << 24);
+		} else {
+			sink_command(s, opcode, params, plen);
+		}
+
+		offset += 3 + plen;
+	}
+
+	if (got != 0 || !feof(in)) {
+		fprintf(stderr, "%s: truncated at offset %ld\n", name, offset);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+read_raw(FILE *in, uint32_t addr, struct sink *s)
+{
+	uint8_t buf[4096];
+	size_t n;
+
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+		sink_data(s, addr, buf, n);
+		addr += n;
+	}
+
+	return ferror(in) ? -1 : 0;
+}
+
+/* name.hcd, name@addr for a raw image and anything else is HEX. */
+static int
+convert(const char *arg, struct sink *s)
+{
+	char path[4096];
+	const char *at = strrchr(arg, '@');
+	enum format from = FORMAT_HEX;
+	uint32_t addr = 0;
+
+	snprintf(path, sizeof(path), "%s", arg);
+
+	if (at != NULL) {
+		char *end;
+
+		addr = strtoul(at + 1, &end, 0);
+
+		if (*end == '\0' && end != at + 1) {
+			path[at - arg] = '\0';
+			from = FORMAT_RAW;
+		}
+	}
+
+	size_t len = strlen(path);
+
+	if (from != FORMAT_RAW && len > 4 && strcasecmp(&path[len - 4], ".hcd") == 0)
+		from = FORMAT_HCD;
+
+	FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+
+	if (in == NULL) {
+		fprintf(stderr, "%s could not be opened, error %d\n", path, errno);
+		return -1;
+	}
+
+	int ret = from == FORMAT_HCD ? read_hcd(in, path, s) :
+		from == FORMAT_RAW ? read_raw(in, addr, s) : read_hex(in, path, s);
+
+	if (in != stdin)
+		fclose(in);
+
+	return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"to",			1,	NULL, 't'},
+		{"launch",	1,	NULL, 'l'},
+		{"output",	1,	NULL, 'o'},
+		{"help",		0,	NULL, 'h'},
+		{0,					0,	0,		0}
+	};
+
+	const char *output = NULL;
+	int arg, option_index = 0;
+
+	while ((arg = getopt_long(argc, argv, "t:l:o:h", long_options, &option_index)) != -1) {
+		switch (arg) {
+			case 't':
+				if (strcmp(optarg, "hcd") == 0) {
+					settings.to = FORMAT_HCD;
+				} else if (strcmp(optarg, "hex") == 0) {
+					settings.to = FORMAT_HEX;
+				} else {
+					fprintf(stderr, "--to takes hcd or hex\n");
+					exit(1);
+				}
+				break;
+
+			case 'l':
+				settings.launch = strtoul(optarg, NULL, 0);
+				settings.launch_given = 1;
+				break;
+
+			case 'o':
+				output = optarg;
+				break;
+
+			case '?':
+			case 'h':
+			default:
+				printf("Usage %s:\n", argv[0]);
+				printf("\t--to hcd|hex - output format\n");
+				printf("\t--launch addr - Launch_RAM address\n");
+				printf("\t--output file\n");
+				printf("\tinput ... - file.hcd, file.hex or file.bin@addr\n");
+				exit(0);
+		}
+	}
+
+	if (optind == argc) {
+		fprintf(stderr, "usage: %s [--to hcd|hex] [--launch addr] [--output file] input ...\n", argv[0]);
+		exit(1);
+	}
+
+	struct sink s = { .out = stdout };
+
+	if (output && (s.out = fopen(output, "wb")) == NULL) {
+		fprintf(stderr, "%s could not be created, error %d\n", output, errno);
+		exit(2);
+	}
+
+	for (int i = optind; i < argc; i++) {
+		if (convert(argv[i], &s) == -1)
+			exit(3);
+	}
+
+	sink_end(&s);
+
+	if (s.dropped)
+		fprintf(stderr, "dropped %u records HEX cannot hold\n", s.dropped);
+
+	if (fflush(s.out) == EOF || (s.out != stdout && fclose(s.out) == EOF)) {
+		fprintf(stderr, "write failed, error %d\n", errno);
+		exit(2);
+	}
+
+	return 0;
+}
@@ -0,0 +1,389 @@
+/*
+ *  hcd-info.c
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ *  Name: hcd-info.c
+ *
+ *  Description:
+ *
+ *   Describe an HCD file and predict what downloading it will cost: the
+ *   records it holds, the RAM it writes, overlapping writes, the
+ *   payload sizes and, for every rate in brcm_baud_rates[], the
+ *   download time sent one record at a time (as brcm_patchram_plus
+ *   does), pipelined (as brcm_patchram_plus_usb does) and with adjacent
+ *   Write_RAMs coalesced.  It ends with whether switching the UART up
+ *   for the download (--use_baudrate_for_download) pays off.
+ *
+ *   It can be invoked from the command line in the form:
+ *
+ *     --turnaround <usec>  - controller time per command (default 150)
+ *     --baud <rate>        - the rate the recommendation is for
+ *                            (default the fastest one)
+ *     hcd_file
+ *
+ *  The model counts 10 bits per byte on the wire, the H4 command and a
+ *  7 byte Command Complete per record, and the turnaround once per
+ *  command.  Measure the turnaround with brcm_patchram_plus --stats.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "baud.h"
+#include "hcd.h"
+
+#define CC_BYTES					7			/* H4 Command Complete with a status. */
+#define MAX_WRITE_DATA		251		/* 255 parameter bytes less the address. */
+#define UPDATE_BAUD_BYTES	10		/* H4 Update_UART_Baud_Rate. */
+
+struct settings {
+	unsigned	turnaround_us;
+	int				baud;
+} settings = { 150, 0 };
+
+/* What the download looks like on the wire. */
+struct load {
+	unsigned	commands;
+	uint64_t	tx_bytes;				/* H4 commands. */
+};
+
+static const char *
+opcode_name(uint16_t opcode)
+{
+	switch (opcode) {
+		case 0xfc2e:				return "Download_Minidriver";
+		case HCD_WRITE_RAM:	return "Write_RAM";
+		case HCD_READ_RAM:	return "Read_RAM";
+		case HCD_LAUNCH_RAM:	return "Launch_RAM";
+		default:						return NULL;
+	}
+}
+
+static int
+by_addr(const void *a, const void *b)
+{
+	const struct hcd_range *x = a, *y = b;
+
+	if (x->addr != y->addr)
+		return x->addr < y->addr ? -1 : 1;
+
+	return x->offset < y->offset ? -1 : 1;
+}
+
+static void
+list_records(const struct hcd_image *hcd)
+{
+	struct { uint16_t opcode; unsigned count; uint64_t bytes; } seen[32];
+	unsigned kinds = 0, i;
+	struct hcd_record rec;
+	size_t offset = 0;
+	int ret;
+
+	while ((ret = hcd_record_at(hcd, offset, &rec)) == 1) {
+		for (i = 0; i < kinds && seen[i].opcode != rec.opcode; i++)
+			;
+
+		if (i == kinds && kinds < sizeof(seen) / sizeof(seen[0]))
+			seen[kinds++] = (typeof(seen[0])) { rec.opcode, 0, 0 };
+
+		if (i < kinds) {
+			seen[i].count++;
+			seen[i].bytes += rec.plen;
+		}
+
+		offset = rec.next;
+	}
+
+	printf("%zu bytes", hcd->size);
+
+	if (ret == -1)
+		printf(", truncated at offset %zu", offset);
+
+	printf("\n\nrecords:\n");
+
+	for (i = 0; i < kinds; i++) {
+		const char *name = opcode_name(seen[i].opcode);
+
+		printf("  0x%04x %-20s %6u records %8llu parameter bytes\n", seen[i].opcode,
+			name ? name : "", seen[i].count, (unsigned long long)seen[i].bytes);
+	}
+}
+
+/* Contiguous extents of RAM written, then writes that land on bytes an
+   earlier or later record writes as well. */
+static void
+list_ranges(struct hcd_range *ranges, int count)
+{
+	unsigned overlaps = 0;
+	int i;
+
+	qsort(ranges, count, sizeof(*ranges), by_addr);
+
+	printf("\nRAM written:\n");
+
+	for (i = 0; i < count; ) {
+		uint32_t start = ranges[i].addr;
+		uint64_t end = (uint64_t)start + ranges[i].len;
+		int j;
+
+		for (j = i + 1; j < count && ranges[j].addr <= end; j++) {
+			if ((uint64_t)ranges[j].addr + ranges[j].len > end)
+				end = (uint64_t)ranges[j].addr + ranges[j].len;
+		}
+
+		printf("  0x%08x-0x%08llx %8llu bytes, %d records\n", start,
+			(unsigned long long)end - 1, (unsigned long long)(end - start), j - i);
+		i = j;
+	}
+
+	for (i = 1; i < count; i++) {
+		const struct hcd_range *a = &ranges[i - 1], *b = &ranges[i];
+
+		if ((uint64_t)a->addr + a->len <= b->addr)
+			continue;
+
+		if (overlaps++ < 8)
+			printf("  overlap: 0x%08x+%u at offset %zu and 0x%08x+%u at offset %zu\n",
+				a->addr, a->len, a->offset, b->addr, b->len, b->offset);
+	}
+
+	if (overlaps > 8)
+		printf("  ... %u overlapping writes in all\n", overlaps);
+	else if (overlaps == 0)
+		printf("  no overlapping writes\n");
+}
+
+static void
+list_sizes(const struct hcd_range *ranges, int count)
+{
+	static const unsigned bounds[] = { 16, 32, 64, 128, 192, 250, MAX_WRITE_DATA };
+	unsigned buckets[sizeof(bounds) / sizeof(bounds[0])] = { 0 };
+	unsigned n = sizeof(bounds) / sizeof(bounds[0]), i, most = 1;
+
+	for (int r = 0; r < count; r++) {
+		for (i = 0; i < n - 1 && ranges[r].len > bounds[i]; i++)
+			;
+		buckets[i]++;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (buckets[i] > most)
+			most = buckets[i];
+	}
+
+	printf("\nWrite_RAM payload sizes:\n");
+
+	for (i = 0; i < n; i++) {
+		char bar[41];
+		unsigned len = buckets[i] * 40 / most;
+
+		memset(bar, '#', len);
+		bar[len] = '\0';
+		printf("  %3u-%3u %6u %s\n", i ? bounds[i - 1] + 1 : 1, bounds[i], buckets[i], bar);
+	}
+}
+
+/* Every record as it is in the file. */
+static void
+load_as_is(const struct hcd_image *hcd, struct load *load)
+{
+	struct hcd_record rec;
+	size_t offset = 0;
+
+	while (hcd_record_at(hcd, offset, &rec) == 1) {
+		load->commands++;
+		load->tx_bytes += 4 + rec.plen;
+		offset = rec.next;
+	}
+}
+
+/* Runs of Write_RAMs to consecutive addresses merged into records of up
+   to MAX_WRITE_DATA bytes; other records stay as they are. */
+static void
+load_coalesced(const struct hcd_image *hcd, struct load *load)
+{
+	struct hcd_record rec;
+	size_t offset = 0;
+	uint64_t run_end = 0;
+	unsigned run_len = 0;
+
+	while (hcd_record_at(hcd, offset, &rec) == 1) {
+		offset = rec.next;
+
+		if (rec.opcode == HCD_WRITE_RAM && rec.plen > 4) {
+			uint32_t addr = hcd_record_addr(&rec);
+			unsigned len = rec.plen - 4;
+
+			if (run_len && addr == run_end && run_len + len <= MAX_WRITE_DATA) {
+				load->tx_bytes += len;
+				run_len += len;
+				run_end += len;
+				continue;
+			}
+
+			run_len = len;
+			run_end = (uint64_t)addr + len;
+		} else {
+			run_len = 0;
+		}
+
+		load->commands++;
+		load->tx_bytes += 4 + rec.plen;
+	}
+}
+
+static double
+wire_us(uint64_t bytes, int rate)
+{
+	return bytes * 10 * 1e6 / rate;
+}
+
+/* One command at a time: each waits for the previous completion. */
+static double
+sequential_us(const struct load *load, int rate)
+{
+	return wire_us(load->tx_bytes + (uint64_t)load->commands * CC_BYTES, rate) +
+		(double)load->commands * settings.turnaround_us;
+}
+
+/* Commands kept in flight: the link carries commands and completions at
+   the same time, so the slower of sending and the controller working
+   through them sets the pace, plus the completion of the last one. */
+static double
+pipelined_us(const struct load *load, int rate)
+{
+	double tx = wire_us(load->tx_bytes, rate);
+	double work = (double)load->commands * settings.turnaround_us;
+
+	return (tx > work ? tx : work) + settings.turnaround_us + wire_us(CC_BYTES, rate);
+}
+
+/* Switching up costs the Update_UART_Baud_Rate round trip at 115200,
+   and Launch_RAM drops the controller back to 115200 for free. */
+static double
+switch_us(void)
+{
+	return wire_us(UPDATE_BAUD_BYTES + CC_BYTES, 115200) + settings.turnaround_us;
+}
+
+static void
+plan(const struct hcd_image *hcd)
+{
+	struct load as_is = { 0 }, coalesced = { 0 };
+	int best = settings.baud;
+
+	load_as_is(hcd, &as_is);
+	load_coalesced(hcd, &coalesced);
+
+	printf("\ndownload time, ms (%u commands, %u coalesced; %u us turnaround):\n",
+		as_is.commands, coalesced.commands, settings.turnaround_us);
+	printf("  %8s %10s %10s %10s %10s\n", "baud", "one-by-one", "pipelined",
+		"coalesced", "both");
+
+	for (unsigned i = 0; i < brcm_baud_rates_count; i++) {
+		int rate = brcm_baud_rates[i].rate;
+
+		printf("  %8d %10.1f %10.1f %10.1f %10.1f\n", rate,
+			sequential_us(&as_is, rate) / 1e3, pipelined_us(&as_is, rate) / 1e3,
+			sequential_us(&coalesced, rate) / 1e3, pipelined_us(&coalesced, rate) / 1e3);
+
+		if (!settings.baud && rate > best)
+			best = rate;
+	}
+
+	double slow = sequential_us(&as_is, 115200);
+	double fast = sequential_us(&as_is, best) + switch_us();
+
+	printf("\n--use_baudrate_for_download at %d: %.1f ms instead of %.1f ms, ",
+		best, fast / 1e3, slow / 1e3);
+
+	if (fast < slow)
+		printf("saves %.1f ms (%.0f%%)\n", (slow - fast) / 1e3, 100 * (slow - fast) / slow);
+	else
+		printf("does not pay off; the download is bound by the turnaround\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	static struct option long_options[] = {
+		{"turnaround",	1,	NULL, 't'},
+		{"baud",				1,	NULL, 'b'},
+		{"help",				0,	NULL, 'h'},
+		{0,							0,	0,		0}
+	};
+
+	int arg, option_index = 0;
+	while ((arg = getopt_long(argc, argv, "t:b:h", long_options, &option_index)) != -1) {
+		switch (arg) {
+			case 't':
+				settings.turnaround_us = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'b':
+				settings.baud = atoi(optarg);
+
+				if (validate_baudrate(settings.baud) == -1) {
+					fprintf(stderr, "Baudrate %d is not supported\n", settings.baud);
+					exit(1);
+				}
+				break;
+
+			case '?':
+			case 'h':
+			default:
+				printf("Usage %s:\n", argv[0]);
+				printf("\t--turnaround usec - controller time per command\n");
+				printf("\t--baud rate - the download rate to recommend for\n");
+				printf("\thcd_file\n");
+				exit(0);
+		}
+	}
+
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [--turnaround usec] [--baud rate] hcd_file\n", argv[0]);
+		exit(1);
+	}
+
+	struct hcd_image hcd;
+	struct hcd_range *ranges;
+	int fd = open(argv[optind], O_RDONLY), count;
+
+	if (fd == -1 || hcd_map(&hcd, fd) == -1) {
+		fprintf(stderr, "%s could not be read, error %d\n", argv[optind], errno);
+		exit(2);
+	}
+
+	list_records(&hcd);
+
+	if ((count = hcd_write_ram_ranges(&hcd, &ranges)) == -1) {
+		fprintf(stderr, "%s is not a complete HCD file\n", argv[optind]);
+		exit(3);
+	}
+
+	list_ranges(ranges, count);
+	list_sizes(ranges, count);
+	plan(&hcd);
+
+	free(ranges);
+	hcd_unmap(&hcd);
+	return 0;
+}
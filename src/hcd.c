@@ -0,0 +1,114 @@
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "hcd.h"
+
+/* Map the whole file read-only.  Records are then decoded in place
+   and any of them can be revisited without seeking. */
+int
+hcd_map(struct hcd_image *hcd, int fd)
+{
+	struct stat st;
+
+	hcd->data = NULL;
+	hcd->size = 0;
+	hcd->map = NULL;
+
+	if (fstat(fd, &st) == -1)
+		return -1;
+
+	if (st.st_size == 0)
+		return 0;
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (map == MAP_FAILED)
+		return -1;
+
+	hcd->data = hcd->map = map;
+	hcd->size = st.st_size;
+	return 0;
+}
+
+void
+hcd_unmap(struct hcd_image *hcd)
+{
+	if (hcd->map != NULL)
+		munmap(hcd->map, hcd->size);
+
+	hcd->map = NULL;
+	hcd->data = NULL;
+	hcd->size = 0;
+}
+
+/* Decode the record starting at offset.  Returns 1 for a record, 0 at
+   the end of the image and -1 if the record is cut short. */
+int
+hcd_record_at(const struct hcd_image *hcd, size_t offset, struct hcd_record *rec)
+{
+	if (offset >= hcd->size)
+		return 0;
+
+	if (hcd->size - offset < 3)
+		return -1;
+
+	const uint8_t *p = &hcd->data[offset];
+
+	rec->opcode = p[0] | (p[1] << 8);
+	rec->plen = p[2];
+	rec->params = &p[3];
+	rec->offset = offset;
+	rec->next = offset + 3 + rec->plen;
+
+	return rec->next <= hcd->size ? 1 : -1;
+}
+
+/* Write_RAM and Launch_RAM start with the little-endian target address. */
+uint32_t
+hcd_record_addr(const struct hcd_record *rec)
+{
+	if (rec->plen < 4)
+		return 0;
+
+	return rec->params[0] | (rec->params[1] << 8) | (rec->params[2] << 16) | ((uint32_t)rec->params[3] << 24);
+}
+
+/* Collect the Write_RAM records of the image, in file order, into a
+   malloc()ed array.  Returns the number of ranges or -1. */
+int
+hcd_write_ram_ranges(const struct hcd_image *hcd, struct hcd_range **ranges)
+{
+	struct hcd_record rec;
+	size_t offset = 0;
+	int count = 0, ret;
+
+	while ((ret = hcd_record_at(hcd, offset, &rec)) == 1) {
+		if (rec.opcode == HCD_WRITE_RAM && rec.plen > 4)
+			count++;
+		offset = rec.next;
+	}
+
+	if (ret == -1 || (*ranges = malloc((count ? count : 1) * sizeof(**ranges))) == NULL)
+		return -1;
+
+	count = 0;
+	offset = 0;
+
+	while (hcd_record_at(hcd, offset, &rec) == 1) {
+		if (rec.opcode == HCD_WRITE_RAM && rec.plen > 4) {
+			struct hcd_range *r = &(*ranges)[count++];
+
+			r->addr = hcd_record_addr(&rec);
+			r->len = rec.plen - 4;
+			r->data = rec.params + 4;
+			r->offset = rec.offset;
+		}
+		offset = rec.next;
+	}
+
+	return count;
+}
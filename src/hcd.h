@@ -0,0 +1,43 @@
+
+#ifndef _HAVE_HCD_H
+#define _HAVE_HCD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HCD_WRITE_RAM		0xfc4c
+#define HCD_READ_RAM		0xfc4d
+#define HCD_LAUNCH_RAM	0xfc4e
+
+/* An HCD file is a plain sequence of HCI commands without the H4
+   packet type: opcode (little endian), parameter length, parameters. */
+struct hcd_record {
+	uint16_t			opcode;
+	uint8_t				plen;
+	const uint8_t	*params;
+	size_t				offset;		/* of this record in the image. */
+	size_t				next;			/* of the record after it. */
+};
+
+/* The bytes one Write_RAM record puts at addr. */
+struct hcd_range {
+	uint32_t			addr;
+	uint32_t			len;
+	const uint8_t	*data;
+	size_t				offset;		/* of the record in the image. */
+};
+
+struct hcd_image {
+	const uint8_t	*data;
+	size_t				size;
+	void					*map;			/* non-NULL if data is our mapping. */
+};
+
+/* hcd.c */
+int hcd_map(struct hcd_image *hcd, int fd);
+void hcd_unmap(struct hcd_image *hcd);
+int hcd_record_at(const struct hcd_image *hcd, size_t offset, struct hcd_record *rec);
+uint32_t hcd_record_addr(const struct hcd_record *rec);
+int hcd_write_ram_ranges(const struct hcd_image *hcd, struct hcd_range **ranges);
+
+#endif
@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "inventory.h"
+
+/* One line of JSON per device, well below PIPE_BUF. */
+#define INVENTORY_LINE	512
+
+/* Not monotonic_us(): the USB tool links this without common.o. */
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* The first thing that went wrong is the one worth reporting. */
+void
+inventory_fail(struct brcm_inventory *inv, uint16_t opcode, const char *what)
+{
+	if (inv->error[0] == '\0') {
+		snprintf(inv->error, sizeof(inv->error), "0x%04x: %s", opcode, what);
+	}
+}
+
+/* Take the return parameters of opcode's Command Complete, status
+   first.  Returns 0 if the command succeeded. */
+int
+inventory_complete(struct brcm_inventory *inv, uint16_t opcode, const uint8_t *ret, size_t len)
+{
+	char what[32];
+
+	if (len < 1) {
+		inventory_fail(inv, opcode, "empty answer");
+		return -1;
+	}
+
+	if (ret[0] != 0) {
+		snprintf(what, sizeof(what), "status 0x%02x", ret[0]);
+		inventory_fail(inv, opcode, what);
+		return -1;
+	}
+
+	switch (opcode) {
+		case INVENTORY_OP_LOCAL_VERSION:
+			if (len < 9)
+				goto short_answer;
+
+			inv->hci_version = ret[1];
+			inv->hci_revision = ret[2] | ret[3] << 8;
+			inv->lmp_version = ret[4];
+			inv->manufacturer = ret[5] | ret[6] << 8;
+			inv->lmp_subversion = ret[7] | ret[8] << 8;
+			inv->have_version = 1;
+			break;
+
+		case INVENTORY_OP_BDADDR:
+			if (len < 7)
+				goto short_answer;
+
+			memcpy(inv->bdaddr, &ret[1], 6);
+			inv->have_bdaddr = 1;
+			break;
+
+		case INVENTORY_OP_VERBOSE_CONFIG:
+			if (len < 7)
+				goto short_answer;
+
+			inv->chip_id = ret[1];
+			inv->target_id = ret[2];
+			inv->build_base = ret[3] | ret[4] << 8;
+			inv->build_num = ret[5] | ret[6] << 8;
+			inv->have_config = 1;
+			break;
+	}
+
+	return 0;
+
+short_answer:
+	inventory_fail(inv, opcode, "short answer");
+	return -1;
+}
+
+/* Device names come from the command line, so quote them properly. */
+static size_t
+json_string(char *out, size_t size, const char *s)
+{
+	size_t n = 0;
+
+	for (; *s && n + 8 < size; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			n += snprintf(&out[n], size - n, "\\%c", c);
+		else if (c < 0x20)
+			n += snprintf(&out[n], size - n, "\\u%04x", c);
+		else
+			out[n++] = c;
+	}
+
+	out[n] = '\0';
+	return n;
+}
+
+#define APPEND(...) \
+	(n += snprintf(&out[n], n < size ? size - n : 0, __VA_ARGS__))
+
+/* Format one device as a line of JSON.  Fields the controller did not
+   answer for are left out.  Returns the length of the line. */
+int
+inventory_json(char *out, size_t size, const char *device, const struct brcm_inventory *inv,
+	unsigned elapsed_ms)
+{
+	char name[128];
+	size_t n = 0;
+
+	json_string(name, sizeof(name), device);
+	APPEND("{\"device\":\"%s\"", name);
+
+	if (inv->have_config) {
+		APPEND(",\"chip_id\":%u,\"target_id\":%u,\"build_base\":%u,\"build_num\":%u",
+			inv->chip_id, inv->target_id, inv->build_base, inv->build_num);
+	}
+
+	/* The firmware version as Linux's btbcm prints it. */
+	if (inv->have_version) {
+		APPEND(",\"hci_version\":%u,\"hci_revision\":%u,\"lmp_version\":%u"
+			",\"manufacturer\":%u,\"lmp_subversion\":%u"
+			",\"firmware\":\"%03u.%03u.%03u\",\"build\":%u",
+			inv->hci_version, inv->hci_revision, inv->lmp_version,
+			inv->manufacturer, inv->lmp_subversion,
+			(inv->lmp_subversion & 0xe000) >> 13, (inv->lmp_subversion & 0x1f00) >> 8,
+			inv->lmp_subversion & 0x00ff, inv->hci_revision & 0x0fff);
+	}
+
+	if (inv->have_bdaddr) {
+		APPEND(",\"bdaddr\":\"%02X:%02X:%02X:%02X:%02X:%02X\"",
+			inv->bdaddr[5], inv->bdaddr[4], inv->bdaddr[3],
+			inv->bdaddr[2], inv->bdaddr[1], inv->bdaddr[0]);
+	}
+
+	APPEND(",\"elapsed_ms\":%u", elapsed_ms);
+
+	if (inv->error[0]) {
+		json_string(name, sizeof(name), inv->error);
+		APPEND(",\"error\":\"%s\"", name);
+	}
+
+	APPEND("}\n");
+	return n < size ? (int)n : (int)size - 1;
+}
+
+struct prober {
+	char		*device;
+	pid_t		pid;
+	int			fd;
+	size_t	len;
+	char		line[INVENTORY_LINE];
+};
+
+static void
+probe_child(struct prober *p, int (*probe)(char *device, struct brcm_inventory *inv))
+{
+	struct brcm_inventory inv;
+	uint64_t start = now_ms();
+
+	memset(&inv, 0, sizeof(inv));
+
+	int ret = probe(p->device, &inv);
+
+	if (ret != 0 && inv.error[0] == '\0') {
+		snprintf(inv.error, sizeof(inv.error), "no answer");
+	}
+
+	int len = inventory_json(p->line, sizeof(p->line), p->device, &inv, now_ms() - start);
+
+	/* A single write, so the parent never sees half a line. */
+	if (write(p->fd, p->line, len) != len)
+		_exit(2);
+
+	_exit(ret == 0 ? 0 : 1);
+}
+
+/* Print what a prober said, or a line of our own if it said nothing.
+   Returns 0 if it got everything it asked for. */
+static int
+probe_done(struct prober *p, const char *why, uint64_t start)
+{
+	int status = 0;
+
+	close(p->fd);
+	p->fd = -1;
+
+	while (waitpid(p->pid, &status, 0) == -1 && errno == EINTR)
+		;
+
+	if (p->len == 0 || p->line[p->len - 1] != '\n') {
+		struct brcm_inventory inv;
+
+		memset(&inv, 0, sizeof(inv));
+		snprintf(inv.error, sizeof(inv.error), "%s", why);
+		p->len = inventory_json(p->line, sizeof(p->line), p->device, &inv, now_ms() - start);
+		status = 1;
+	}
+
+	fwrite(p->line, 1, p->len, stdout);
+	fflush(stdout);
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/*
+ * Probe every device at once, each from its own process so a wedged
+ * UART or socket holds up nobody else, and print one JSON line per
+ * device as it finishes.  Whoever is still busy when deadline_ms runs
+ * out is killed and reported as such.  Returns the number of devices
+ * that did not answer everything.
+ */
+int
+inventory_run(char **devices, int count, int deadline_ms,
+	int (*probe)(char *device, struct brcm_inventory *inv))
+{
+	struct prober *p = calloc(count, sizeof(*p));
+	struct pollfd *pfd = calloc(count, sizeof(*pfd));
+	uint64_t start = now_ms();
+	int running = 0, failed = 0;
+
+	if (p == NULL || pfd == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	/* Children must not flush what we have buffered a second time. */
+	fflush(stdout);
+	fflush(stderr);
+
+	for (int i = 0; i < count; i++) {
+		int pipefd[2];
+
+		p[i].device = devices[i];
+		p[i].fd = -1;
+
+		if (pipe(pipefd) == -1) {
+			fprintf(stderr, "%s: could not start a probe: %s\n", devices[i], strerror(errno));
+			failed++;
+			continue;
+		}
+
+		if ((p[i].pid = fork()) == -1) {
+			fprintf(stderr, "%s: could not start a probe: %s\n", devices[i], strerror(errno));
+			close(pipefd[0]);
+			close(pipefd[1]);
+			failed++;
+			continue;
+		}
+
+		if (p[i].pid == 0) {
+			close(pipefd[0]);
+			p[i].fd = pipefd[1];
+			probe_child(&p[i], probe);
+		}
+
+		close(pipefd[1]);
+		p[i].fd = pipefd[0];
+		running++;
+	}
+
+	while (running > 0) {
+		int64_t left = (int64_t)start + deadline_ms - (int64_t)now_ms();
+
+		if (left <= 0)
+			break;
+
+		/* Finished probers have fd -1, which poll() skips. */
+		for (int i = 0; i < count; i++) {
+			pfd[i].fd = p[i].fd;
+			pfd[i].events = POLLIN;
+		}
+
+		int ready = poll(pfd, count, left);
+
+		if (ready == -1 && errno == EINTR)
+			continue;
+
+		if (ready <= 0)
+			break;
+
+		for (int i = 0; i < count; i++) {
+			if (p[i].fd == -1 || !pfd[i].revents)
+				continue;
+
+			ssize_t got = read(p[i].fd, &p[i].line[p[i].len], sizeof(p[i].line) - p[i].len);
+
+			if (got > 0) {
+				p[i].len += got;
+				continue;
+			}
+
+			if (probe_done(&p[i], "probe died", start) != 0)
+				failed++;
+
+			running--;
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (p[i].fd == -1)
+			continue;
+
+		kill(p[i].pid, SIGKILL);
+		p[i].len = 0;
+		probe_done(&p[i], "deadline", start);
+		failed++;
+	}
+
+	free(pfd);
+	free(p);
+	return failed;
+}
@@ -0,0 +1,50 @@
+
+#ifndef _HAVE_INVENTORY_H
+#define _HAVE_INVENTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* How long a probe waits for each answer, in milliseconds. */
+#define INVENTORY_TIMEOUT		500
+
+/* Default for the whole run, all devices together. */
+#define INVENTORY_DEADLINE	3000
+
+/* The only commands a probe sends. */
+#define INVENTORY_OP_RESET					0x0c03
+#define INVENTORY_OP_LOCAL_VERSION	0x1001
+#define INVENTORY_OP_BDADDR					0x1009
+#define INVENTORY_OP_VERBOSE_CONFIG	0xfc79
+
+/* What --probe learns about one controller.  Each have_ flag says
+   whether the matching command answered. */
+struct brcm_inventory {
+	int				have_version;
+	uint8_t		hci_version;
+	uint16_t	hci_revision;
+	uint8_t		lmp_version;
+	uint16_t	manufacturer;
+	uint16_t	lmp_subversion;
+
+	int				have_bdaddr;
+	uint8_t		bdaddr[6];				/* as it comes off the wire, LSB first. */
+
+	int				have_config;
+	uint8_t		chip_id;
+	uint8_t		target_id;
+	uint16_t	build_base;
+	uint16_t	build_num;
+
+	char			error[64];				/* empty unless something went wrong. */
+};
+
+/* inventory.c */
+int inventory_complete(struct brcm_inventory *inv, uint16_t opcode, const uint8_t *ret, size_t len);
+void inventory_fail(struct brcm_inventory *inv, uint16_t opcode, const char *what);
+int inventory_json(char *out, size_t size, const char *device, const struct brcm_inventory *inv,
+	unsigned elapsed_ms);
+int inventory_run(char **devices, int count, int deadline_ms,
+	int (*probe)(char *device, struct brcm_inventory *inv));
+
+#endif
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "common.h"
+#include "metrics.h"
+
+struct metrics metrics = { .chip_id = -1 };
+int metrics_enabled = 0;
+
+/* Upper bounds of the round-trip histogram, in microseconds.  The last
+   bucket is +Inf. */
+static const uint32_t rtt_bounds_us[] = {
+	250, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 250000, 1000000,
+};
+
+#define RTT_BUCKETS	(sizeof(rtt_bounds_us) / sizeof(rtt_bounds_us[0]) + 1)
+
+static struct {
+	const char	*name;
+	uint64_t		us;
+} phases[METRICS_MAX_PHASES];
+
+static unsigned phase_count;
+static uint64_t rtt_buckets[RTT_BUCKETS];
+static uint64_t rtt_sum_us;
+static uint64_t rtt_count;
+static uint64_t start_us;
+static const char *tool_name;
+static const char *final_path;
+static char *tmp_path;
+static FILE *out;
+
+/* Steps that run more than once, like reset, add up under one name. */
+void
+metrics_phase(const char *name, uint64_t us)
+{
+	unsigned i;
+
+	if (!metrics_enabled)
+		return;
+
+	for (i = 0; i < phase_count; i++) {
+		if (strcmp(phases[i].name, name) == 0)
+			break;
+	}
+
+	if (i == METRICS_MAX_PHASES)
+		return;
+
+	if (i == phase_count) {
+		phases[phase_count++].name = name;
+	}
+
+	phases[i].us += us;
+}
+
+void
+metrics_command(uint64_t rtt_us)
+{
+	unsigned i;
+
+	if (!metrics_enabled)
+		return;
+
+	for (i = 0; i < RTT_BUCKETS - 1 && rtt_us > rtt_bounds_us[i]; i++)
+		;
+
+	rtt_buckets[i]++;
+	rtt_sum_us += rtt_us;
+	rtt_count++;
+}
+
+static void
+gauge(const char *name, const char *help, double value)
+{
+	fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s{tool=\"%s\"} %.15g\n",
+		name, help, name, name, tool_name, value);
+}
+
+static void
+write_metrics(int ok)
+{
+	uint64_t cumulative = 0;
+	unsigned i;
+
+	gauge("brcm_patchram_success", "1 if the last session completed.", ok);
+	gauge("brcm_patchram_last_run_timestamp_seconds", "When the last session ended.",
+		time(NULL));
+	gauge("brcm_patchram_session_seconds", "Duration of the last session.",
+		(monotonic_us() - start_us) / 1e6);
+
+	fprintf(out, "# HELP brcm_patchram_phase_seconds Time spent in each phase.\n"
+		"# TYPE brcm_patchram_phase_seconds gauge\n");
+
+	for (i = 0; i < phase_count; i++) {
+		fprintf(out, "brcm_patchram_phase_seconds{tool=\"%s\",phase=\"%s\"} %.9g\n",
+			tool_name, phases[i].name, phases[i].us / 1e6);
+	}
+
+	fprintf(out, "# HELP brcm_patchram_command_rtt_seconds HCI command to event round trip.\n"
+		"# TYPE brcm_patchram_command_rtt_seconds histogram\n");
+
+	for (i = 0; i < RTT_BUCKETS; i++) {
+		cumulative += rtt_buckets[i];
+
+		if (i < RTT_BUCKETS - 1) {
+			fprintf(out, "brcm_patchram_command_rtt_seconds_bucket{tool=\"%s\",le=\"%g\"} %llu\n",
+				tool_name, rtt_bounds_us[i] / 1e6, (unsigned long long)cumulative);
+		} else {
+			fprintf(out, "brcm_patchram_command_rtt_seconds_bucket{tool=\"%s\",le=\"+Inf\"} %llu\n",
+				tool_name, (unsigned long long)cumulative);
+		}
+	}
+
+	fprintf(out, "brcm_patchram_command_rtt_seconds_sum{tool=\"%s\"} %.9g\n"
+		"brcm_patchram_command_rtt_seconds_count{tool=\"%s\"} %llu\n",
+		tool_name, rtt_sum_us / 1e6, tool_name, (unsigned long long)rtt_count);
+
+	gauge("brcm_patchram_records_sent", "HCD records sent, retransmissions included.",
+		metrics.records);
+	gauge("brcm_patchram_bytes_sent", "Bytes of HCD records sent.", metrics.bytes);
+	gauge("brcm_patchram_timeouts", "Commands that got no answer in time.", metrics.timeouts);
+	gauge("brcm_patchram_retransmissions", "HCD records sent again.",
+		metrics.retransmissions);
+
+	if (metrics.baudrate) {
+		gauge("brcm_patchram_download_baudrate", "UART rate the firmware was sent at.",
+			metrics.baudrate);
+	}
+
+	if (metrics.chip_id != -1) {
+		gauge("brcm_patchram_chip_id", "Chip id from the verbose config.", metrics.chip_id);
+	}
+}
+
+/* Write the file next to its final name and rename it into place, so
+   the collector never reads half of it.  Called from atexit(), which
+   reports error exits as unsuccessful, or with ok set at the end of a
+   good session. */
+void
+metrics_close(int ok)
+{
+	if (out == NULL)
+		return;
+
+	write_metrics(ok);
+
+	if (fflush(out) == EOF || fsync(fileno(out)) == -1) {
+		fclose(out);
+		unlink(tmp_path);
+	} else {
+		fclose(out);
+
+		if (rename(tmp_path, final_path) == -1) {
+			unlink(tmp_path);
+		}
+	}
+
+	out = NULL;
+	metrics_enabled = 0;
+	free(tmp_path);
+	tmp_path = NULL;
+}
+
+static void
+metrics_exit(void)
+{
+	metrics_close(0);
+}
+
+/* The temporary file is created here so a bad path is reported up
+   front.  Its name does not end in .prom, which the collector skips. */
+int
+metrics_open(const char *path, const char *tool)
+{
+	size_t len = strlen(path) + 16;
+
+	if ((tmp_path = malloc(len)) == NULL)
+		return -1;
+
+	snprintf(tmp_path, len, "%s.%d", path, (int)getpid());
+
+	if ((out = fopen(tmp_path, "w")) == NULL) {
+		free(tmp_path);
+		tmp_path = NULL;
+		return -1;
+	}
+
+	final_path = path;
+	tool_name = tool;
+	start_us = monotonic_us();
+	metrics_enabled = 1;
+	atexit(metrics_exit);
+	return 0;
+}
@@ -0,0 +1,29 @@
+
+#ifndef _HAVE_METRICS_H
+#define _HAVE_METRICS_H
+
+#include <stdint.h>
+
+/* Numbers for one patch session, written at exit in the Prometheus
+   text format for node_exporter's textfile collector. */
+#define METRICS_MAX_PHASES	16
+
+struct metrics {
+	unsigned	records;			/* HCD records sent, retransmissions included. */
+	uint64_t	bytes;				/* of those records. */
+	unsigned	timeouts;
+	unsigned	retransmissions;
+	int				baudrate;			/* the download ran at. */
+	int				chip_id;
+};
+
+extern struct metrics metrics;
+extern int metrics_enabled;
+
+/* metrics.c */
+int metrics_open(const char *path, const char *tool);
+void metrics_phase(const char *name, uint64_t us);
+void metrics_command(uint64_t rtt_us);
+void metrics_close(int ok);
+
+#endif
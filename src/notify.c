@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "notify.h"
+
+#ifndef HCIUARTGETDEVICE
+#define HCIUARTGETDEVICE	_IOR('U', 202, int)
+#endif
+
+#ifndef HCI_CHANNEL_MONITOR
+#define HCI_CHANNEL_MONITOR	2
+#endif
+
+/* From the kernel's hci_mon.h, which BlueZ does not install. */
+#define HCI_MON_NEW_INDEX	0
+
+struct notify_mon_hdr {
+	uint16_t	opcode;
+	uint16_t	index;
+	uint16_t	len;
+} __attribute__ ((packed));
+
+/* --ready_fd: a pipe or an eventfd whoever started us waits on. */
+int notify_fd = -1;
+
+int
+parse_ready_fd(const char *arg)
+{
+	char *end;
+
+	notify_fd = strtol(arg, &end, 0);
+
+	if (*end != '\0' || notify_fd < 0 || fcntl(notify_fd, F_GETFD) == -1) {
+		fprintf(stderr, "--ready_fd %s is not an open descriptor\n", arg);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Open the HCI monitor before the line discipline goes on, so the
+   new index cannot slip past.  Needs CAP_NET_ADMIN; returns -1 without
+   it, and we make do with HCIUARTGETDEVICE alone. */
+int
+notify_monitor_open(void)
+{
+	struct sockaddr_hci addr;
+	int mon = socket(AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, BTPROTO_HCI);
+
+	if (mon == -1)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.hci_family = AF_BLUETOOTH;
+	addr.hci_dev = HCI_DEV_NONE;
+	addr.hci_channel = HCI_CHANNEL_MONITOR;
+
+	if (bind(mon, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		close(mon);
+		return -1;
+	}
+
+	return mon;
+}
+
+/* Pick up any New Index the monitor has for dev_id.  Every index that
+   exists when the socket is bound is announced first, so one that
+   registered before we looked is not missed either. */
+static int
+monitor_saw(int mon, int dev_id)
+{
+	uint8_t packet[sizeof(struct notify_mon_hdr) + HCI_MAX_FRAME_SIZE];
+	struct notify_mon_hdr hdr;
+	ssize_t len;
+
+	while ((len = read(mon, packet, sizeof(packet))) >= (ssize_t)sizeof(hdr)) {
+		memcpy(&hdr, packet, sizeof(hdr));
+
+		if (btohs(hdr.opcode) == HCI_MON_NEW_INDEX && btohs(hdr.index) == dev_id)
+			return 1;
+	}
+
+	return 0;
+}
+
+static uint64_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Wait up to timeout milliseconds for the line discipline on uart_fd
+ * to have registered its hciN and, when mon is open, for the monitor
+ * to have announced it.  Returns N, or -1 if that did not happen.
+ */
+int
+notify_hci_registered(int uart_fd, int mon, int timeout)
+{
+	uint64_t deadline = now_ms() + timeout;
+	int dev_id = -1, seen = 0;
+
+	do {
+		if (dev_id < 0)
+			dev_id = ioctl(uart_fd, HCIUARTGETDEVICE, 0);
+
+		if (dev_id >= 0 && mon == -1)
+			return dev_id;
+
+		if (dev_id >= 0 && !seen)
+			seen = monitor_saw(mon, dev_id);
+
+		if (seen)
+			return dev_id;
+
+		struct pollfd pfd = { .fd = mon, .events = POLLIN };
+
+		/* HCIUARTGETDEVICE has nothing to wait on, so look again
+			 every 50 ms until it has an answer. */
+		poll(&pfd, mon == -1 ? 0 : 1, 50);
+	} while (now_ms() < deadline);
+
+	return -1;
+}
+
+/* Tell systemd, for Type=notify units. */
+static void
+sd_notify_send(const char *msg)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (path == NULL || (path[0] != '/' && path[0] != '@') ||
+			strlen(path) >= sizeof(addr.sun_path))
+		return;
+
+	memcpy(addr.sun_path, path, strlen(path));
+
+	/* An abstract socket. */
+	if (path[0] == '@')
+		addr.sun_path[0] = '\0';
+
+	int s = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	if (s == -1)
+		return;
+
+	if (sendto(s, msg, strlen(msg), MSG_NOSIGNAL, (struct sockaddr *)&addr,
+			offsetof(struct sockaddr_un, sun_path) + strlen(path)) == -1)
+		fprintf(stderr, "could not notify %s, error %d\n", path, errno);
+
+	close(s);
+}
+
+/*
+ * --background: hand control back to whoever started us and patch
+ * from a child, so the rest of boot goes on meanwhile.  Those that
+ * need the controller wait on --ready_fd or on systemd.  Under a
+ * Type=notify unit the child first tells systemd it is the main
+ * process now (which takes NotifyAccess=all), and the parent waits for
+ * that before it exits, so systemd never sees its main process go
+ * without a word.  If the child fails, it exits without a word on
+ * --ready_fd and the reader sees end of file.
+ */
+void
+notify_background(void)
+{
+	int handoff[2];
+	char c = 0;
+
+	fflush(stdout);
+	fflush(stderr);
+
+	if (pipe(handoff) == -1) {
+		fprintf(stderr, "could not go to the background, error %d\n", errno);
+		return;
+	}
+
+	pid_t pid = fork();
+
+	if (pid == -1) {
+		fprintf(stderr, "could not go to the background, error %d\n", errno);
+		close(handoff[0]);
+		close(handoff[1]);
+		return;
+	}
+
+	/* Not exit(): the atexit() handlers belong to the child now.  End
+	   of file is as good as the byte: either way the child is done
+	   with systemd. */
+	if (pid > 0) {
+		close(handoff[1]);
+
+		while (read(handoff[0], &c, 1) == -1 && errno == EINTR)
+			;
+
+		_exit(0);
+	}
+
+	close(handoff[0]);
+	setsid();
+
+	char msg[32];
+
+	snprintf(msg, sizeof(msg), "MAINPID=%d\n", (int)getpid());
+	sd_notify_send(msg);
+
+	if (write(handoff[1], &c, 1) != 1)
+		fprintf(stderr, "could not release the foreground, error %d\n", errno);
+
+	close(handoff[1]);
+
+	int null = open("/dev/null", O_RDONLY);
+
+	if (null != -1) {
+		dup2(null, STDIN_FILENO);
+		close(null);
+	}
+}
+
+static int
+is_eventfd(int fd)
+{
+	char path[64], target[64];
+	ssize_t len;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+	if ((len = readlink(path, target, sizeof(target) - 1)) == -1)
+		return 0;
+
+	target[len] = '\0';
+	return strcmp(target, "anon_inode:[eventfd]") == 0;
+}
+
+/*
+ * Say that device -- hciN, or the uart when nothing was attached -- is
+ * ready: READY=1 to systemd, and on --ready_fd either a count of 1 for
+ * an eventfd or the device name and a newline for a pipe.
+ */
+void
+notify_ready(const char *device)
+{
+	char msg[128];
+
+	snprintf(msg, sizeof(msg), "READY=1\nSTATUS=%s is ready\n", device);
+	sd_notify_send(msg);
+
+	if (notify_fd == -1)
+		return;
+
+	if (is_eventfd(notify_fd)) {
+		uint64_t one = 1;
+
+		if (write(notify_fd, &one, sizeof(one)) != sizeof(one))
+			fprintf(stderr, "could not signal --ready_fd, error %d\n", errno);
+	} else {
+		int len = snprintf(msg, sizeof(msg), "%s\n", device);
+
+		if (write(notify_fd, msg, len) != len)
+			fprintf(stderr, "could not write to --ready_fd, error %d\n", errno);
+	}
+
+	close(notify_fd);
+	notify_fd = -1;
+}
+
+/* Say why there will be no notify_ready(), so nobody waits for it:
+   --ready_fd is closed without a word. */
+void
+notify_failed(const char *why)
+{
+	char msg[128];
+
+	snprintf(msg, sizeof(msg), "STATUS=%s\n", why);
+	sd_notify_send(msg);
+
+	if (notify_fd != -1) {
+		close(notify_fd);
+		notify_fd = -1;
+	}
+}
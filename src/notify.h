@@ -0,0 +1,19 @@
+
+#ifndef _HAVE_NOTIFY_H
+#define _HAVE_NOTIFY_H
+
+/* How long the kernel gets to register hciN once the line discipline
+   is set, in milliseconds. */
+#define NOTIFY_TIMEOUT	5000
+
+extern int notify_fd;
+
+/* notify.c */
+int parse_ready_fd(const char *arg);
+void notify_background(void);
+int notify_monitor_open(void);
+int notify_hci_registered(int uart_fd, int mon, int timeout);
+void notify_ready(const char *device);
+void notify_failed(const char *why);
+
+#endif
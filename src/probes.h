@@ -0,0 +1,70 @@
+
+#ifndef _HAVE_PROBES_H
+#define _HAVE_PROBES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * USDT probes, provider brcm_patchram, for bpftrace, perf and
+ * SystemTap to attach to a running tool (see contrib/bpftrace).  Each
+ * probe site is a single nop until a tracer attaches, and the arguments
+ * are values the code already has at hand.  Without <sys/sdt.h>, or
+ * with -DNO_SDT, the probes compile to nothing.
+ *
+ *   cmd_send(opcode, plen)
+ *   event_recv(event, opcode, status)   opcode and status of a Command
+ *                                       Complete/Status, else 0 and -1
+ *   record_start(offset, opcode)
+ *   record_end(offset, status)          status -1 if it timed out
+ *   retransmit(offset, try)
+ *   h5_retransmit(packet)               "sync" or "config"
+ *   baud_switch(rate)
+ *   reset()
+ */
+#if !defined(NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define BRCM_HAVE_SDT
+#endif
+#endif
+
+#ifdef BRCM_HAVE_SDT
+#define PROBE0(name)						DTRACE_PROBE(brcm_patchram, name)
+#define PROBE1(name, a)					DTRACE_PROBE1(brcm_patchram, name, a)
+#define PROBE2(name, a, b)			DTRACE_PROBE2(brcm_patchram, name, a, b)
+#define PROBE3(name, a, b, c)		DTRACE_PROBE3(brcm_patchram, name, a, b, c)
+#else
+#define PROBE0(name)						do { } while (0)
+#define PROBE1(name, a)					do { } while (0)
+#define PROBE2(name, a, b)			do { } while (0)
+#define PROBE3(name, a, b, c)		do { } while (0)
+#endif
+
+/* An H4 command: 0x01, opcode, plen, parameters. */
+#define PROBE_CMD(h4)	PROBE2(cmd_send, (h4)[1] | ((h4)[2] << 8), (h4)[3])
+
+/* An H4 event: 0x04, event code, plen, parameters. */
+static inline void
+probe_event(const uint8_t *h4, size_t len)
+{
+#ifdef BRCM_HAVE_SDT
+	unsigned opcode = 0;
+	int status = -1;
+
+	if (len >= 7 && h4[1] == 0x0e) {
+		opcode = h4[4] | (h4[5] << 8);
+		status = h4[6];
+	} else if (len >= 7 && h4[1] == 0x0f) {
+		opcode = h4[5] | (h4[6] << 8);
+		status = h4[3];
+	}
+
+	PROBE3(event_recv, h4[1], opcode, status);
+#else
+	(void)h4;
+	(void)len;
+#endif
+}
+
+#endif
@@ -0,0 +1,114 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "realtime.h"
+
+/* Stack the download loop may touch, faulted in up front. */
+#define REALTIME_STACK	(64 * 1024)
+
+/* What realtime_enter() changed, so it can be put back. */
+static struct {
+	int									active;
+	int									policy;
+	struct sched_param	param;
+	int									have_affinity;
+	cpu_set_t						affinity;
+	int									locked;
+} saved;
+
+static void __attribute__ ((noinline))
+prefault_stack(void)
+{
+	volatile unsigned char stack[REALTIME_STACK];
+
+	for (size_t i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+/* Read a byte of every page, so the download does not stop for a
+   fault on the image halfway through. */
+void
+realtime_prefault(const void *data, size_t size)
+{
+	const volatile unsigned char *p = data;
+	long page = sysconf(_SC_PAGESIZE);
+
+	for (size_t i = 0; i < size; i += page)
+		(void)p[i];
+}
+
+/*
+ * Run the calling thread under SCHED_FIFO at priority, on cpu if it is
+ * not -1, with every page we have now or map later locked in.  Each
+ * part that fails is reported and the rest carried on with; returns -1
+ * if anything failed.  Only this thread is affected, the btsnoop
+ * writer keeps normal scheduling.
+ */
+int
+realtime_enter(int priority, int cpu)
+{
+	struct sched_param param = { .sched_priority = priority };
+	int ret = 0;
+
+	if (saved.active)
+		return 0;
+
+	saved.active = 1;
+	saved.policy = sched_getscheduler(0);
+	sched_getparam(0, &saved.param);
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+
+		if (sched_getaffinity(0, sizeof(saved.affinity), &saved.affinity) == 0 &&
+				sched_setaffinity(0, sizeof(set), &set) == 0) {
+			saved.have_affinity = 1;
+		} else {
+			fprintf(stderr, "realtime: could not move to cpu %d: %s\n", cpu, strerror(errno));
+			ret = -1;
+		}
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) {
+		saved.locked = 1;
+	} else {
+		fprintf(stderr, "realtime: could not lock memory: %s\n", strerror(errno));
+		ret = -1;
+	}
+
+	prefault_stack();
+
+	if (sched_setscheduler(0, SCHED_FIFO, &param) == -1) {
+		fprintf(stderr, "realtime: could not use SCHED_FIFO %d: %s\n", priority, strerror(errno));
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/* Back to the scheduling, cpus and paging we started with. */
+void
+realtime_leave(void)
+{
+	if (!saved.active)
+		return;
+
+	sched_setscheduler(0, saved.policy, &saved.param);
+
+	if (saved.have_affinity)
+		sched_setaffinity(0, sizeof(saved.affinity), &saved.affinity);
+
+	if (saved.locked)
+		munlockall();
+
+	memset(&saved, 0, sizeof(saved));
+}
@@ -0,0 +1,16 @@
+
+#ifndef _HAVE_REALTIME_H
+#define _HAVE_REALTIME_H
+
+#include <stddef.h>
+
+/* Below the 50 threaded interrupt handlers run at, so the UART's own
+   handler still gets in ahead of us. */
+#define REALTIME_PRIORITY	40
+
+/* realtime.c */
+int realtime_enter(int priority, int cpu);
+void realtime_leave(void);
+void realtime_prefault(const void *data, size_t size);
+
+#endif
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "session.h"
+
+int session_enabled = 0;
+
+static FILE *out;
+static uint64_t last_us;
+
+/* Not monotonic_us(): brcm_replay reads sessions without common.o. */
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+put_uleb(uint64_t v)
+{
+	do {
+		uint8_t b = v & 0x7f;
+
+		v >>= 7;
+		putc_unlocked(v ? b | 0x80 : b, out);
+	} while (v);
+}
+
+static void
+put_header(uint8_t type)
+{
+	uint64_t now = now_us();
+
+	putc_unlocked(type, out);
+	put_uleb(now - last_us);
+	last_us = now;
+}
+
+/* Called right where the bytes were written or read, so the deltas are
+   the timing the controller actually showed. */
+void
+session_io(const uint8_t *data, size_t len, int received)
+{
+	if (!session_enabled || len == 0)
+		return;
+
+	put_header(received ? SESSION_RECEIVED : SESSION_SENT);
+	put_uleb(len);
+	fwrite(data, 1, len, out);
+}
+
+void
+session_baud(int rate)
+{
+	if (!session_enabled)
+		return;
+
+	put_header(SESSION_BAUD);
+	put_uleb(rate);
+}
+
+void
+session_close(void)
+{
+	if (out == NULL)
+		return;
+
+	fclose(out);
+	out = NULL;
+	session_enabled = 0;
+}
+
+/* Records go through a large stdio buffer and the file is closed from
+   atexit(), which covers the error exits -- a failing session is the
+   one most worth keeping. */
+int
+session_open(const char *path)
+{
+	if ((out = fopen(path, "w")) == NULL)
+		return -1;
+
+	setvbuf(out, NULL, _IOFBF, 1 << 16);
+	fwrite(SESSION_MAGIC, 1, 8, out);
+
+	last_us = now_us();
+	session_enabled = 1;
+	atexit(session_close);
+	return 0;
+}
+
+static int
+get_uleb(FILE *in, uint64_t *v)
+{
+	int c, shift = 0;
+
+	*v = 0;
+
+	do {
+		if ((c = getc(in)) == EOF || shift > 63)
+			return -1;
+
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return 0;
+}
+
+/* Returns 0 if in starts with a session header, -1 if not. */
+int
+session_read_header(FILE *in)
+{
+	char magic[8];
+
+	if (fread(magic, 1, 8, in) != 8 || memcmp(magic, SESSION_MAGIC, 8) != 0)
+		return -1;
+
+	return 0;
+}
+
+/* Returns 1 for a record, 0 at the end of the session and -1 if it is
+   cut short or malformed. */
+int
+session_read(FILE *in, struct session_record *rec)
+{
+	uint64_t len;
+	int type;
+
+	if ((type = getc(in)) == EOF)
+		return 0;
+
+	if (type > SESSION_BAUD || get_uleb(in, &rec->delta_us) == -1 || get_uleb(in, &len) == -1)
+		return -1;
+
+	rec->type = type;
+	rec->len = len;
+
+	if (type == SESSION_BAUD)
+		return 1;
+
+	if (len > SESSION_MAX_DATA || fread(rec->data, 1, len, in) != len)
+		return -1;
+
+	return 1;
+}
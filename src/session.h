@@ -0,0 +1,41 @@
+
+#ifndef _HAVE_SESSION_H
+#define _HAVE_SESSION_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A recorded session is everything that crossed the UART, in order:
+ * after an 8 byte magic, each record is a type byte, the microseconds
+ * since the previous record and then either the bytes or the new baud
+ * rate.  Numbers are unsigned LEB128, so a typical Write_RAM round
+ * trip costs 6 bytes on top of the data.
+ */
+#define SESSION_MAGIC			"BRCMSES1"
+
+#define SESSION_SENT			0		/* host to controller */
+#define SESSION_RECEIVED	1		/* controller to host */
+#define SESSION_BAUD			2
+
+#define SESSION_MAX_DATA	1024
+
+struct session_record {
+	uint8_t		type;
+	uint64_t	delta_us;
+	uint32_t	len;							/* of data, or the baud rate. */
+	uint8_t		data[SESSION_MAX_DATA];
+};
+
+extern int session_enabled;
+
+/* session.c */
+int session_open(const char *path);
+void session_io(const uint8_t *data, size_t len, int received);
+void session_baud(int rate);
+void session_close(void);
+int session_read_header(FILE *in);
+int session_read(FILE *in, struct session_record *rec);
+
+#endif
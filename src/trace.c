@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+int trace_enabled = 0;
+
+static struct trace_event *events;
+static unsigned count;
+static unsigned dropped;
+static FILE *out;
+static const char *process_name;
+
+/* Write the trace out.  Called from atexit(), or before a tool parks
+   itself to keep the line discipline attached. */
+void
+trace_close(void)
+{
+	int pid = getpid();
+
+	if (out == NULL)
+		return;
+
+	fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+		"\"args\":{\"name\":\"%s\"}}", pid, pid, process_name);
+
+	for (unsigned i = 0; i < count; i++) {
+		const struct trace_event *e = &events[i];
+
+		fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,"
+			"\"dur\":%u,\"pid\":%d,\"tid\":%d", e->name, e->cat,
+			(unsigned long long)e->start_us, e->dur_us, pid, pid);
+
+		if (e->arg != -1)
+			fprintf(out, ",\"args\":{\"offset\":%d}", e->arg);
+
+		fprintf(out, "}");
+	}
+
+	fprintf(out, "\n],\"otherData\":{\"dropped\":%u}}\n", dropped);
+	fclose(out);
+	out = NULL;
+
+	free(events);
+	events = NULL;
+	trace_enabled = 0;
+}
+
+/* Start recording.  The file is opened here so a bad path is reported
+   up front; it is written from an atexit() handler, which covers the
+   error exits as well. */
+int
+trace_open(const char *path, const char *process)
+{
+	if ((events = malloc(TRACE_MAX_EVENTS * sizeof(*events))) == NULL)
+		return -1;
+
+	if ((out = fopen(path, "w")) == NULL) {
+		free(events);
+		events = NULL;
+		return -1;
+	}
+
+	process_name = process;
+	trace_enabled = 1;
+	atexit(trace_close);
+	return 0;
+}
+
+/* Recording is a bounds check and a store; once the buffer is full,
+   further spans are only counted. */
+void
+trace_span(const char *cat, const char *name, uint64_t start_us, uint64_t end_us, int32_t arg)
+{
+	if (!trace_enabled)
+		return;
+
+	if (count == TRACE_MAX_EVENTS) {
+		dropped++;
+		return;
+	}
+
+	events[count++] = (struct trace_event) {
+		.cat = cat,
+		.name = name,
+		.start_us = start_us,
+		.dur_us = end_us > start_us ? end_us - start_us : 0,
+		.arg = arg,
+	};
+}
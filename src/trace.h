@@ -0,0 +1,26 @@
+
+#ifndef _HAVE_TRACE_H
+#define _HAVE_TRACE_H
+
+#include <stdint.h>
+
+/* Spans are kept in memory and written out as Chrome trace-event JSON
+   (loads in Perfetto and chrome://tracing) when the program exits. */
+#define TRACE_MAX_EVENTS	16384
+
+struct trace_event {
+	const char	*cat;
+	const char	*name;
+	uint64_t		start_us;
+	uint32_t		dur_us;
+	int32_t			arg;		/* offset of an HCD record, or -1. */
+};
+
+extern int trace_enabled;
+
+/* trace.c */
+int trace_open(const char *path, const char *process);
+void trace_span(const char *cat, const char *name, uint64_t start_us, uint64_t end_us, int32_t arg);
+void trace_close(void);
+
+#endif